@@ -0,0 +1,151 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/events.h"
+
+/*
+ * Turns an allocation event log into a Chrome trace:
+ *
+ *   MALLOC_EVENTS=app.events LD_PRELOAD=$PWD/lib/libmalloc.so app
+ *   bench/events app.events > app.json
+ *
+ * and load app.json in chrome://tracing or ui.perfetto.dev.  Calls into
+ * the allocator are slices on their thread's track and heap growth,
+ * splits and coalesces are instants inside them.  Time stamp counter
+ * ticks are converted to time using the first and last clock records.
+ */
+
+static const char *const names[] =
+{
+  [EVENT_MALLOC] = "malloc", [EVENT_CALLOC] = "calloc",
+  [EVENT_REALLOC] = "realloc", [EVENT_FREE] = "free",
+  [EVENT_GROW] = "grow", [EVENT_SPLIT] = "split",
+  [EVENT_COALESCE] = "coalesce", [EVENT_CLOCK] = "clock",
+  [EVENT_DROPPED] = "dropped"
+};
+
+/*
+ * \brief printArgs
+ *
+ * \return none
+ */
+static void printArgs(const struct _event *e)
+{
+  switch (e->type)
+  {
+    case EVENT_MALLOC:
+    case EVENT_CALLOC:
+      printf("\"ptr\": \"%#" PRIx64 "\", \"size\": %" PRIu64, e->a, e->b);
+      break;
+    case EVENT_REALLOC:
+      printf("\"ptr\": \"%#" PRIx64 "\", \"size\": %" PRIu64
+             ", \"old\": \"%#" PRIx64 "\"", e->a, e->b, e->c);
+      break;
+    case EVENT_FREE:
+      printf("\"ptr\": \"%#" PRIx64 "\"", e->a);
+      break;
+    case EVENT_GROW:
+      printf("\"at\": \"%#" PRIx64 "\", \"bytes\": %" PRIu64, e->a, e->b);
+      break;
+    case EVENT_SPLIT:
+      printf("\"block\": \"%#" PRIx64 "\", \"size\": %" PRIu64
+             ", \"remainder\": %" PRIu64, e->a, e->b, e->c);
+      break;
+    case EVENT_COALESCE:
+      printf("\"block\": \"%#" PRIx64 "\", \"size\": %" PRIu64, e->a, e->b);
+      break;
+    case EVENT_DROPPED:
+      printf("\"events\": %" PRIu64, e->a);
+      break;
+  }
+  printf(", \"arena\": %d", e->arena);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s events-file > trace.json\n", argv[0]);
+    return 2;
+  }
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < EVENTS_MAGIC_SIZE)
+  {
+    fprintf(stderr, "events: cannot read %s\n", argv[1]);
+    return 1;
+  }
+  const char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED || memcmp(base, EVENTS_MAGIC, EVENTS_MAGIC_SIZE) != 0)
+  {
+    fprintf(stderr, "events: %s is not an allocation event log\n", argv[1]);
+    return 1;
+  }
+  const struct _event *events = (const struct _event *)(base + EVENTS_MAGIC_SIZE);
+  size_t count = (st.st_size - EVENTS_MAGIC_SIZE) / sizeof(struct _event);
+
+  /* Fit ticks to nanoseconds through the outermost clock records */
+  const struct _event *first = NULL;
+  const struct _event *last = NULL;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (events[i].type == EVENT_CLOCK)
+    {
+      first = first ? first : &events[i];
+      last = &events[i];
+    }
+  }
+  if (first == NULL)
+  {
+    fprintf(stderr, "events: %s has no clock records\n", argv[1]);
+    return 1;
+  }
+  double nsPerTick = last->tsc > first->tsc ?
+                     (double)(last->a - first->a) / (last->tsc - first->tsc) :
+                     1;
+
+  printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  bool separator = false;
+  size_t dropped = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    const struct _event *e = &events[i];
+    if (e->type == EVENT_CLOCK || e->type == 0 || e->type > EVENT_DROPPED)
+    {
+      continue;
+    }
+    dropped += e->type == EVENT_DROPPED ? e->a : 0;
+    double ts = ((double)e->tsc - (double)first->tsc) * nsPerTick / 1000;
+    printf("%s{\"name\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, ",
+           separator ? ",\n" : "", names[e->type], e->tid, ts);
+    if (e->type <= EVENT_FREE)
+    {
+      printf("\"ph\": \"X\", \"cat\": \"call\", \"dur\": %.3f, ",
+             e->duration * nsPerTick / 1000);
+    }
+    else
+    {
+      printf("\"ph\": \"i\", \"s\": \"t\", \"cat\": \"heap\", ");
+    }
+    printf("\"args\": {");
+    printArgs(e);
+    printf("}}");
+    separator = true;
+  }
+  printf("\n]}\n");
+
+  if (dropped)
+  {
+    fprintf(stderr, "events: %zu events were dropped by full buffers\n",
+            dropped);
+  }
+  return 0;
+}
@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Microbenchmarks for the allocator hot paths.  Run it with the library
+ * under test preloaded:
+ *
+ *   LD_PRELOAD=$PWD/lib/libmalloc-ff.so bench/micro [-t threads]
+ *              [-w baseline] [-c baseline] [-r percent]
+ *
+ * Every benchmark is run REPEAT times and the fastest run is kept.  Each
+ * thread times one operation in SAMPLE_EVERY for the latency columns.
+ * -w saves the results as a baseline and -c compares against one,
+ * exiting with status 1 if any throughput fell by more than -r percent
+ * (default 10) and with status 2 if the baseline cannot be read.
+ * Latency is reported but not gated: the percentiles are too noisy
+ * across runs to fail a build on.
+ *
+ * Memory the harness needs for itself is mmap'd so that the allocator
+ * only sees the calls being measured.
+ */
+#define REPEAT            5
+#define SAMPLE_EVERY      16
+#define FIXED_SIZE        64     /* Bytes, for the fixed size benchmarks */
+#define WINDOW            1024   /* Live objects per thread */
+#define RING_SIZE         1024   /* Producer/consumer queue length */
+#define MAX_THREADS       64
+#define MAX_BENCHES       16
+
+struct _ring
+{
+   _Atomic size_t head;                 /* Next slot the producer fills */
+   char pad[64];
+   _Atomic size_t tail;                 /* Next slot the consumer empties */
+   void *slots[RING_SIZE];
+};
+
+struct _worker
+{
+   const struct _bench *bench;
+   int       index;
+   uint64_t  ops;
+   uint32_t *sizes;                     /* Precomputed request sizes */
+   uint64_t *samples;                   /* Nanoseconds per sampled op */
+   size_t    count;                     /* Samples taken */
+   struct _ring *ring;
+   pthread_barrier_t *start;
+};
+
+struct _bench
+{
+   const char *name;
+   void (*body)(struct _worker *);
+   bool      threaded;                  /* Uses -t threads, else one */
+   bool      random;                    /* Random sizes, else FIXED_SIZE */
+   uint64_t  ops;                       /* Per thread */
+};
+
+struct _result
+{
+   char   name[32];
+   double opsPerSec;
+   double p50;
+   double p99;
+};
+
+static inline uint64_t nanoseconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void *mapZero(size_t size)
+{
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+  {
+    perror("mmap");
+    _exit(2);
+  }
+  return ptr;
+}
+
+/*
+ * \brief churn
+ *
+ * Replaces a random object in a window of live ones per op, so frees
+ * are not simply undoing the previous malloc.
+ *
+ * \return none
+ */
+static void churn(struct _worker *w)
+{
+  void *window[WINDOW] = { NULL };
+  uint64_t start = 0;
+  for (uint64_t i = 0; i < w->ops; i++)
+  {
+    bool sampled = i % SAMPLE_EVERY == 0;
+    size_t slot = (i * 7919) % WINDOW;
+    if (sampled)
+    {
+      start = nanoseconds();
+    }
+    free(window[slot]);
+    window[slot] = malloc(w->sizes[i]);
+    if (sampled)
+    {
+      w->samples[w->count++] = nanoseconds() - start;
+    }
+    *(char *)window[slot] = 1;
+  }
+  for (int i = 0; i < WINDOW; i++)
+  {
+    free(window[i]);
+  }
+}
+
+/*
+ * \brief produce
+ *
+ * Thread pairs: even workers allocate and queue objects, odd workers
+ * take them off the queue and free them, so every free is remote.
+ *
+ * \return none
+ */
+static void produce(struct _worker *w)
+{
+  struct _ring *ring = w->ring;
+  uint64_t start = 0;
+  for (uint64_t i = 0; i < w->ops; i++)
+  {
+    bool sampled = i % SAMPLE_EVERY == 0;
+    if (w->index % 2 == 0)
+    {
+      size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+      while (head - atomic_load_explicit(&ring->tail, memory_order_acquire)
+             == RING_SIZE)
+      {
+        sched_yield();
+      }
+      if (sampled)
+      {
+        start = nanoseconds();
+      }
+      void *ptr = malloc(w->sizes[i]);
+      if (sampled)
+      {
+        w->samples[w->count++] = nanoseconds() - start;
+      }
+      *(char *)ptr = 1;
+      ring->slots[head % RING_SIZE] = ptr;
+      atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+    else
+    {
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+      {
+        sched_yield();
+      }
+      void *ptr = ring->slots[tail % RING_SIZE];
+      atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+      if (sampled)
+      {
+        start = nanoseconds();
+      }
+      free(ptr);
+      if (sampled)
+      {
+        w->samples[w->count++] = nanoseconds() - start;
+      }
+    }
+  }
+}
+
+/*
+ * \brief grow
+ *
+ * Appends to buffers with realloc, 48 bytes at a time up to 16 KB, the
+ * way a string builder would.  A small allocation is kept alive between
+ * buffers so the buffer does not always sit at the top of the heap.
+ *
+ * \return none
+ */
+static void grow(struct _worker *w)
+{
+  char *buffer = NULL;
+  void *pin = NULL;
+  size_t length = 0;
+  uint64_t start = 0;
+  for (uint64_t i = 0; i < w->ops; i++)
+  {
+    if (length >= 16 * 1024)
+    {
+      free(buffer);
+      free(pin);
+      pin = malloc(32);
+      buffer = NULL;
+      length = 0;
+    }
+    length += 48;
+    bool sampled = i % SAMPLE_EVERY == 0;
+    if (sampled)
+    {
+      start = nanoseconds();
+    }
+    buffer = realloc(buffer, length);
+    if (sampled)
+    {
+      w->samples[w->count++] = nanoseconds() - start;
+    }
+    buffer[length - 1] = 1;
+  }
+  free(buffer);
+  free(pin);
+}
+
+static const struct _bench benches[] =
+{
+  { "fixed",             churn,   false, false, 1000000 },
+  { "random",            churn,   false, true,  1000000 },
+  { "fixed-threads",     churn,   true,  false, 500000  },
+  { "random-threads",    churn,   true,  true,  500000  },
+  { "producer-consumer", produce, true,  true,  250000  },
+  { "realloc-grow",      grow,    false, false, 1000000 },
+};
+
+/*
+ * \brief randomSize
+ *
+ * \return a size from 16 bytes to 8 KB, weighted towards the small end
+ */
+static uint32_t randomSize(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  uint32_t bits = 4 + *state % 9;
+  return (1u << bits) + (uint32_t)(*state >> 32) % (1u << bits);
+}
+
+static void *runWorker(void *arg)
+{
+  struct _worker *w = arg;
+  pthread_barrier_wait(w->start);
+  w->bench->body(w);
+  return NULL;
+}
+
+static int compareU64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * \brief runBench
+ *
+ * Runs one benchmark with the given thread count, keeping the fastest
+ * of REPEAT runs.
+ *
+ * \return none
+ */
+static void runBench(const struct _bench *bench, int threads,
+                     struct _result *result)
+{
+  struct _worker workers[MAX_THREADS];
+  pthread_t ids[MAX_THREADS];
+  pthread_barrier_t start;
+  uint64_t samplesPer = bench->ops / SAMPLE_EVERY + 1;
+  uint64_t *merged = mapZero(threads * samplesPer * sizeof(uint64_t));
+  struct _ring *rings = mapZero((threads / 2 + 1) * sizeof(struct _ring));
+
+  for (int t = 0; t < threads; t++)
+  {
+    uint64_t state = 0x9E3779B97F4A7C15ull * (t + 1);
+    workers[t].sizes = mapZero(bench->ops * sizeof(uint32_t));
+    workers[t].samples = mapZero(samplesPer * sizeof(uint64_t));
+    for (uint64_t i = 0; i < bench->ops; i++)
+    {
+      workers[t].sizes[i] = bench->random ? randomSize(&state) : FIXED_SIZE;
+    }
+  }
+
+  snprintf(result->name, sizeof(result->name), "%s", bench->name);
+  result->opsPerSec = 0;
+  for (int run = 0; run < REPEAT; run++)
+  {
+    pthread_barrier_init(&start, NULL, threads + 1);
+    memset(rings, 0, (threads / 2 + 1) * sizeof(struct _ring));
+    for (int t = 0; t < threads; t++)
+    {
+      workers[t].bench = bench;
+      workers[t].index = t;
+      workers[t].ops = bench->ops;
+      workers[t].count = 0;
+      workers[t].ring = &rings[t / 2];
+      workers[t].start = &start;
+      pthread_create(&ids[t], NULL, runWorker, &workers[t]);
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = nanoseconds();
+    for (int t = 0; t < threads; t++)
+    {
+      pthread_join(ids[t], NULL);
+    }
+    double seconds = (nanoseconds() - begin) / 1e9;
+    pthread_barrier_destroy(&start);
+
+    double rate = bench->ops * threads / seconds;
+    if (rate <= result->opsPerSec)
+    {
+      continue;
+    }
+    result->opsPerSec = rate;
+
+    size_t count = 0;
+    for (int t = 0; t < threads; t++)
+    {
+      memcpy(merged + count, workers[t].samples,
+             workers[t].count * sizeof(uint64_t));
+      count += workers[t].count;
+    }
+    qsort(merged, count, sizeof(uint64_t), compareU64);
+    result->p50 = count ? merged[count / 2] : 0;
+    result->p99 = count ? merged[(count * 99) / 100] : 0;
+  }
+
+  for (int t = 0; t < threads; t++)
+  {
+    munmap(workers[t].sizes, bench->ops * sizeof(uint32_t));
+    munmap(workers[t].samples, samplesPer * sizeof(uint64_t));
+  }
+  munmap(merged, threads * samplesPer * sizeof(uint64_t));
+  munmap(rings, (threads / 2 + 1) * sizeof(struct _ring));
+}
+
+/*
+ * \brief readBaseline
+ *
+ * \return the throughput saved for name, or 0 if there is none
+ */
+static double readBaseline(const char *path, const char *name)
+{
+  char line[128];
+  char key[32];
+  double rate;
+  double found = 0;
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), file))
+  {
+    if (sscanf(line, "%31s %lf", key, &rate) == 2 && strcmp(key, name) == 0)
+    {
+      found = rate;
+    }
+  }
+  fclose(file);
+  return found;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *save = NULL;
+  const char *compare = NULL;
+  double threshold = 10;
+  int threads = 4;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:w:c:r:")) != -1)
+  {
+    switch (opt)
+    {
+      case 't': threads = atoi(optarg); break;
+      case 'w': save = optarg; break;
+      case 'c': compare = optarg; break;
+      case 'r': threshold = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-t threads] [-w baseline] "
+                "[-c baseline] [-r percent]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (threads < 2)
+  {
+    threads = 2;                        /* One producer/consumer pair */
+  }
+  if (threads > MAX_THREADS)
+  {
+    threads = MAX_THREADS;
+  }
+  threads &= ~1;                        /* Producers each need a consumer */
+  if (compare)
+  {
+    FILE *file = fopen(compare, "r");
+    if (file == NULL)
+    {
+      perror(compare);
+      fprintf(stderr, "no baseline to compare against; save one with -w\n");
+      return 2;
+    }
+    fclose(file);
+  }
+
+  const char *preload = getenv("LD_PRELOAD");
+  printf("allocator: %s, %d threads\n\n", preload ? preload : "glibc", threads);
+  printf("%-18s %14s %9s %9s %10s\n", "benchmark", "ops/sec", "p50 ns",
+         "p99 ns", "baseline");
+
+  size_t count = sizeof(benches) / sizeof(benches[0]);
+  struct _result results[MAX_BENCHES];
+  int regressions = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    runBench(&benches[i], benches[i].threaded ? threads : 1, &results[i]);
+    printf("%-18s %14.0f %9.0f %9.0f", results[i].name,
+           results[i].opsPerSec, results[i].p50, results[i].p99);
+
+    double baseline = compare ? readBaseline(compare, results[i].name) : 0;
+    if (baseline > 0)
+    {
+      double change = (results[i].opsPerSec / baseline - 1) * 100;
+      bool regressed = change < -threshold;
+      regressions += regressed;
+      printf(" %+9.1f%%%s", change, regressed ? "  REGRESSION" : "");
+    }
+    printf("\n");
+  }
+
+  if (save)
+  {
+    FILE *file = fopen(save, "w");
+    if (file == NULL)
+    {
+      perror(save);
+      return 2;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+      fprintf(file, "%s %.0f %.0f %.0f\n", results[i].name,
+              results[i].opsPerSec, results[i].p50, results[i].p99);
+    }
+    fclose(file);
+    printf("\nbaseline written to %s\n", save);
+  }
+  else if (compare && regressions)
+  {
+    printf("\n%d benchmark(s) more than %.0f%% slower than %s\n",
+           regressions, threshold, compare);
+  }
+
+  /* Skip the allocator's exit report so only the table is printed */
+  fflush(stdout);
+  _exit(regressions ? 1 : 0);
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+ * Replays an allocation trace recorded by libtrace.so against a set of
+ * allocators and compares them:
+ *
+ *   bench/replay app.trace lib/libmalloc-ff.so lib/libmalloc-bf.so glibc
+ *
+ * "glibc" stands for the C library's own malloc.  Each allocator is run
+ * in a fresh process, re-executing this program with LD_PRELOAD set,
+ * once to measure throughput, peak RSS and fragmentation and once to
+ * time every operation for the latency percentiles.  Traces from
+ * threaded programs are replayed on one thread in the order recorded.
+ *
+ * Peak RSS is the growth in ru_maxrss over the replay, and
+ * fragmentation is the share of it not explained by the most bytes the
+ * trace ever had live.  The replay writes one byte to every page it is
+ * handed so that memory an allocator hands out is also resident.
+ *
+ * Everything the harness itself needs is mmap'd so that only the
+ * replayed calls go through the allocator under test.
+ */
+#define PAGE              4096
+
+struct _op
+{
+   uint64_t id;          /* Object the op creates or frees */
+   uint64_t old;         /* Object a realloc moves from */
+   uint64_t size;
+   uint64_t alignment;   /* For TRACE_MEMALIGN */
+   uint8_t  kind;        /* TRACE_* */
+};
+
+struct _trace
+{
+   struct _op *ops;
+   size_t count;
+   uint64_t maxId;
+};
+
+struct _result
+{
+   double seconds;
+   size_t ops;
+   long   peakKB;
+   double peakLive;
+   double p50;           /* Nanoseconds */
+   double p99;
+};
+
+/*
+ * \brief mapZero
+ *
+ * \return size bytes of zeroed memory outside of the allocator under test
+ */
+static void *mapZero(size_t size)
+{
+  void *ptr = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+  {
+    perror("mmap");
+    _exit(1);
+  }
+  return ptr;
+}
+
+/*
+ * \brief decodeTrace
+ *
+ * Counts the records when ops is NULL, otherwise fills ops in.  Records
+ * for allocations that failed when the trace was recorded are dropped.
+ *
+ * \return false if the trace is malformed
+ */
+static bool decodeTrace(const uint8_t *in, const uint8_t *end,
+                        struct _trace *trace, struct _op *ops)
+{
+  trace->count = 0;
+  trace->maxId = 0;
+  while (in < end)
+  {
+    struct _op op = { 0, 0, 0, 0, *in++ };
+    switch (op.kind)
+    {
+      case TRACE_MALLOC:
+      case TRACE_CALLOC:
+        in = traceDecode(in, end, &op.id);
+        in = in ? traceDecode(in, end, &op.size) : NULL;
+        break;
+      case TRACE_REALLOC:
+        in = traceDecode(in, end, &op.old);
+        in = in ? traceDecode(in, end, &op.id) : NULL;
+        in = in ? traceDecode(in, end, &op.size) : NULL;
+        /* realloc(ptr, 0) that freed the object replays as a free */
+        if (op.id == 0 && op.old != 0)
+        {
+          op.kind = TRACE_FREE;
+          op.id = op.old;
+          op.old = 0;
+        }
+        break;
+      case TRACE_FREE:
+        in = traceDecode(in, end, &op.id);
+        break;
+      case TRACE_MEMALIGN:
+        in = traceDecode(in, end, &op.id);
+        in = in ? traceDecode(in, end, &op.size) : NULL;
+        in = in ? traceDecode(in, end, &op.alignment) : NULL;
+        break;
+      default:
+        return false;
+    }
+    if (in == NULL)
+    {
+      return false;
+    }
+    if (op.id == 0)
+    {
+      continue;
+    }
+    if (op.id > trace->maxId)
+    {
+      trace->maxId = op.id;
+    }
+    if (ops)
+    {
+      ops[trace->count] = op;
+    }
+    trace->count++;
+  }
+  return true;
+}
+
+/*
+ * \brief loadTrace
+ *
+ * \return false if the file cannot be read or is not a trace
+ */
+static bool loadTrace(const char *path, struct _trace *trace)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < TRACE_MAGIC_SIZE)
+  {
+    fprintf(stderr, "replay: cannot read trace %s\n", path);
+    return false;
+  }
+  const uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED ||
+      memcmp(base, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0)
+  {
+    fprintf(stderr, "replay: %s is not an allocation trace\n", path);
+    return false;
+  }
+
+  const uint8_t *in = base + TRACE_MAGIC_SIZE;
+  const uint8_t *end = base + st.st_size;
+  if (!decodeTrace(in, end, trace, NULL))
+  {
+    fprintf(stderr, "replay: %s is truncated or corrupt\n", path);
+    return false;
+  }
+  trace->ops = mapZero(trace->count * sizeof(struct _op));
+  decodeTrace(in, end, trace, trace->ops);
+  munmap((void *)base, st.st_size);
+  return true;
+}
+
+/*
+ * \brief touch
+ *
+ * Writes one byte in every page of an allocation.
+ *
+ * \return none
+ */
+static inline void touch(char *ptr, uint64_t size)
+{
+  if (ptr == NULL)
+  {
+    return;
+  }
+  for (uint64_t i = 0; i < size; i += PAGE)
+  {
+    ptr[i] = 1;
+  }
+}
+
+static inline uint64_t nanoseconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * \brief replay
+ *
+ * Runs the trace once.  With latency non-NULL each operation is timed
+ * into it, otherwise the live byte count is tracked into peakLive.
+ *
+ * \return none
+ */
+static void replay(const struct _trace *trace, void **objects,
+                   uint64_t *sizes, uint64_t *latency, double *peakLive)
+{
+  double live = 0;
+  uint64_t start = 0;
+
+  for (size_t i = 0; i < trace->count; i++)
+  {
+    const struct _op *op = &trace->ops[i];
+    if (latency)
+    {
+      start = nanoseconds();
+    }
+    switch (op->kind)
+    {
+      case TRACE_MALLOC:
+        objects[op->id] = malloc(op->size);
+        break;
+      case TRACE_CALLOC:
+        objects[op->id] = calloc(1, op->size);
+        break;
+      case TRACE_REALLOC:
+        objects[op->id] = realloc(objects[op->old], op->size);
+        objects[op->old] = NULL;
+        break;
+      case TRACE_FREE:
+        free(objects[op->id]);
+        objects[op->id] = NULL;
+        break;
+      case TRACE_MEMALIGN:
+        objects[op->id] = memalign(op->alignment, op->size);
+        break;
+    }
+    if (latency)
+    {
+      latency[i] = nanoseconds() - start;
+    }
+
+    if (op->kind == TRACE_FREE)
+    {
+      live -= sizes[op->id];
+      sizes[op->id] = 0;
+      continue;
+    }
+    touch(objects[op->id], op->size);
+    live = live - sizes[op->old] + op->size;
+    sizes[op->old] = 0;
+    sizes[op->id] = op->size;
+    if (live > *peakLive)
+    {
+      *peakLive = live;
+    }
+  }
+}
+
+static int compareU64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static long maxRSS(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/*
+ * \brief runChild
+ *
+ * Replays the trace under the preloaded allocator and writes one result
+ * line to stdout.  Exits with _exit() so the allocator's exit hooks
+ * stay out of the measurement and the output.
+ *
+ * \return does not return
+ */
+static void runChild(const char *path, bool timed)
+{
+  struct _trace trace;
+  if (!loadTrace(path, &trace))
+  {
+    _exit(1);
+  }
+  void **objects = mapZero((trace.maxId + 1) * sizeof(void *));
+  uint64_t *sizes = mapZero((trace.maxId + 1) * sizeof(uint64_t));
+  uint64_t *latency = timed ? mapZero(trace.count * sizeof(uint64_t)) : NULL;
+
+  /* Fault the harness's own tables in before the baseline is taken */
+  memset(objects, 0, (trace.maxId + 1) * sizeof(void *));
+  memset(sizes, 0, (trace.maxId + 1) * sizeof(uint64_t));
+  if (latency)
+  {
+    memset(latency, 0, trace.count * sizeof(uint64_t));
+  }
+
+  struct _result result = { 0, trace.count, 0, 0, 0, 0 };
+  long baseline = maxRSS();
+  uint64_t start = nanoseconds();
+  replay(&trace, objects, sizes, latency, &result.peakLive);
+  result.seconds = (nanoseconds() - start) / 1e9;
+  result.peakKB = maxRSS() - baseline;
+
+  if (latency && trace.count)
+  {
+    qsort(latency, trace.count, sizeof(uint64_t), compareU64);
+    result.p50 = latency[trace.count / 2];
+    result.p99 = latency[(trace.count * 99) / 100];
+  }
+
+  char line[256];
+  int n = snprintf(line, sizeof(line), "%.9f %zu %ld %.0f %.0f %.0f\n",
+                   result.seconds, result.ops, result.peakKB,
+                   result.peakLive, result.p50, result.p99);
+  _exit(write(1, line, n) == n ? 0 : 1);
+}
+
+/*
+ * \brief spawn
+ *
+ * Runs this program in the given child mode with lib preloaded, or with
+ * no preload for "glibc", and parses the line it prints.
+ *
+ * \return false if the child failed
+ */
+static bool spawn(const char *mode, const char *trace, const char *lib,
+                  struct _result *result)
+{
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    close(fds[0]);
+    dup2(fds[1], 1);
+    close(fds[1]);
+    if (strcmp(lib, "glibc") == 0)
+    {
+      unsetenv("LD_PRELOAD");
+    }
+    else
+    {
+      char full[PATH_MAX];
+      if (realpath(lib, full) == NULL)
+      {
+        fprintf(stderr, "replay: no such library %s\n", lib);
+        _exit(1);
+      }
+      setenv("LD_PRELOAD", full, 1);
+    }
+    execl("/proc/self/exe", "replay", mode, trace, (char *)NULL);
+    perror("replay: exec");
+    _exit(1);
+  }
+  close(fds[1]);
+
+  char line[256];
+  size_t used = 0;
+  ssize_t n;
+  while (used < sizeof(line) - 1 &&
+         (n = read(fds[0], line + used, sizeof(line) - 1 - used)) > 0)
+  {
+    used += n;
+  }
+  line[used] = '\0';
+  close(fds[0]);
+
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    return false;
+  }
+  return sscanf(line, "%lf %zu %ld %lf %lf %lf", &result->seconds,
+                &result->ops, &result->peakKB, &result->peakLive,
+                &result->p50, &result->p99) == 6;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 3 && (strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "-l") == 0))
+  {
+    runChild(argv[2], argv[1][1] == 'l');
+  }
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: %s trace library.so|glibc ...\n", argv[0]);
+    return 2;
+  }
+
+  struct _trace trace;
+  if (!loadTrace(argv[1], &trace))
+  {
+    return 1;
+  }
+  printf("%s: %zu operations, %lu objects\n\n", argv[1], trace.count,
+         (unsigned long)trace.maxId);
+  printf("%-22s %12s %9s %9s %12s %8s\n", "allocator", "ops/sec",
+         "p50 ns", "p99 ns", "peak RSS KB", "frag");
+
+  int failed = 0;
+  for (int i = 2; i < argc; i++)
+  {
+    struct _result throughput, latency;
+    const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1
+                                             : argv[i];
+    if (!spawn("-t", argv[1], argv[i], &throughput) ||
+        !spawn("-l", argv[1], argv[i], &latency))
+    {
+      printf("%-22s %12s\n", name, "failed");
+      failed = 1;
+      continue;
+    }
+
+    /* RSS cannot show less than what the trace had live */
+    double rss = throughput.peakKB * 1024.0;
+    double frag = rss > throughput.peakLive ? 1 - throughput.peakLive / rss
+                                            : 0;
+    printf("%-22s %12.0f %9.0f %9.0f %12ld %7.1f%%\n", name,
+           throughput.seconds > 0 ? throughput.ops / throughput.seconds : 0,
+           latency.p50, latency.p99, throughput.peakKB, frag * 100);
+  }
+  return failed;
+}
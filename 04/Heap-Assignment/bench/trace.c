@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+ * Allocation trace recorder.  Preload it into a program with
+ *
+ *   MALLOC_TRACE_OUT=app.trace LD_PRELOAD=lib/libtrace.so app
+ *
+ * and every malloc(), calloc(), realloc(), free(), posix_memalign(),
+ * aligned_alloc() and memalign() the program makes is served by the C
+ * library and logged to MALLOC_TRACE_OUT (default
+ * malloc.trace) in the format described in trace.h.  Calls from all
+ * threads go into one trace, in the order they took the recorder's lock.
+ * A forked child stops recording, and anything still buffered when a
+ * program execs without exiting is lost.
+ *
+ * The recorder never allocates through malloc() itself: records are
+ * buffered in a static array and the pointer to id table lives in its
+ * own mapping.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+#define BUFFER_SIZE       (64 * 1024)
+#define RECORD_MAX        32     /* Op byte and three varints */
+#define TABLE_MIN         (1 << 16)
+
+struct _entry
+{
+   uintptr_t ptr;        /* 0 marks an empty slot */
+   uint64_t  id;
+};
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static int traceFd        = -1;
+static bool traceOff      = false;   /* Set in forked children */
+static uint8_t buffer[BUFFER_SIZE];
+static size_t used        = 0;
+static uint64_t nextId    = 1;
+static struct _entry *table = NULL;  /* Live pointers, open addressing */
+static size_t tableSize   = 0;
+static size_t tableCount  = 0;
+
+/*
+ * \brief flushBuffer
+ *
+ * Writes out the buffered records, opening the trace file on first use.
+ *
+ * \return none
+ */
+static void flushBuffer(void)
+{
+  if (traceFd == -1)
+  {
+    const char *path = getenv("MALLOC_TRACE_OUT");
+    traceFd = open(path ? path : "malloc.trace",
+                   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (traceFd >= 0 &&
+        write(traceFd, TRACE_MAGIC, TRACE_MAGIC_SIZE) != TRACE_MAGIC_SIZE)
+    {
+      close(traceFd);
+      traceFd = -2;
+    }
+  }
+  size_t done = 0;
+  while (traceFd >= 0 && done < used)
+  {
+    ssize_t n = write(traceFd, buffer + done, used - done);
+    if (n <= 0)
+    {
+      break;
+    }
+    done = done + (size_t)n;
+  }
+  used = 0;
+}
+
+/*
+ * \brief slotOf
+ *
+ * \return the table slot that holds ptr, or the empty slot it would go in
+ */
+static size_t slotOf(uintptr_t ptr)
+{
+  size_t mask = tableSize - 1;
+  size_t i = (size_t)(((ptr >> 4) * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+  while (table[i].ptr && table[i].ptr != ptr)
+  {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/*
+ * \brief tableGrow
+ *
+ * Moves the table to a mapping twice the size.
+ *
+ * \return false if there was no memory for it
+ */
+static bool tableGrow(void)
+{
+  size_t size = tableSize ? tableSize * 2 : TABLE_MIN;
+  struct _entry *fresh = mmap(NULL, size * sizeof(struct _entry),
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (fresh == MAP_FAILED)
+  {
+    return false;
+  }
+  struct _entry *old = table;
+  size_t oldSize = tableSize;
+  table = fresh;
+  tableSize = size;
+  for (size_t i = 0; i < oldSize; i++)
+  {
+    if (old[i].ptr)
+    {
+      table[slotOf(old[i].ptr)] = old[i];
+    }
+  }
+  if (old)
+  {
+    munmap(old, oldSize * sizeof(struct _entry));
+  }
+  return true;
+}
+
+/*
+ * \brief idAdd
+ *
+ * \return a new id for ptr, or 0 if ptr is NULL or the table is full
+ */
+static uint64_t idAdd(void *ptr)
+{
+  if (ptr == NULL || ((tableCount + 1) * 2 > tableSize && !tableGrow()))
+  {
+    return 0;
+  }
+  size_t i = slotOf((uintptr_t)ptr);
+  if (table[i].ptr == 0)
+  {
+    tableCount++;
+  }
+  table[i].ptr = (uintptr_t)ptr;
+  table[i].id = nextId++;
+  return table[i].id;
+}
+
+/*
+ * \brief idRemove
+ *
+ * Forgets ptr, closing the gap it leaves in its probe run.
+ *
+ * \return the id ptr had, or 0 if it was never recorded
+ */
+static uint64_t idRemove(void *ptr)
+{
+  if (ptr == NULL || table == NULL)
+  {
+    return 0;
+  }
+  size_t mask = tableSize - 1;
+  size_t i = slotOf((uintptr_t)ptr);
+  if (table[i].ptr == 0)
+  {
+    return 0;
+  }
+  uint64_t id = table[i].id;
+  table[i].ptr = 0;
+  tableCount--;
+
+  /* Move back any entry that could no longer be found past the hole */
+  for (size_t j = (i + 1) & mask; table[j].ptr; j = (j + 1) & mask)
+  {
+    struct _entry moved = table[j];
+    table[j].ptr = 0;
+    table[slotOf(moved.ptr)] = moved;
+  }
+  return id;
+}
+
+/*
+ * \brief record
+ *
+ * Appends one record.  Called with traceLock held.
+ *
+ * \return none
+ */
+static void record(uint8_t op, int count, uint64_t a, uint64_t b, uint64_t c)
+{
+  if (used + RECORD_MAX > BUFFER_SIZE)
+  {
+    flushBuffer();
+  }
+  buffer[used++] = op;
+  used += traceEncode(buffer + used, a);
+  if (count > 1)
+  {
+    used += traceEncode(buffer + used, b);
+  }
+  if (count > 2)
+  {
+    used += traceEncode(buffer + used, c);
+  }
+}
+
+static void forkChild(void)
+{
+  traceOff = true;
+  used = 0;
+  pthread_mutex_init(&traceLock, NULL);
+}
+
+__attribute__((constructor))
+static void traceInit(void)
+{
+  pthread_atfork(NULL, NULL, forkChild);
+}
+
+__attribute__((destructor))
+static void traceFinish(void)
+{
+  pthread_mutex_lock(&traceLock);
+  if (!traceOff)
+  {
+    flushBuffer();
+  }
+  traceOff = true;
+  pthread_mutex_unlock(&traceLock);
+}
+
+void *malloc(size_t size)
+{
+  void *ptr = __libc_malloc(size);
+  if (!traceOff)
+  {
+    pthread_mutex_lock(&traceLock);
+    record(TRACE_MALLOC, 2, idAdd(ptr), size, 0);
+    pthread_mutex_unlock(&traceLock);
+  }
+  return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  void *ptr = __libc_calloc(nmemb, size);
+  if (!traceOff)
+  {
+    pthread_mutex_lock(&traceLock);
+    record(TRACE_CALLOC, 2, idAdd(ptr), nmemb * size, 0);
+    pthread_mutex_unlock(&traceLock);
+  }
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  if (traceOff)
+  {
+    return __libc_realloc(ptr, size);
+  }
+  /* Held across the call: once ptr is released another thread can be
+     handed the same address, and its id must not be retired here */
+  pthread_mutex_lock(&traceLock);
+  void *moved = __libc_realloc(ptr, size);
+  /* A failed realloc leaves the old object alive */
+  if (moved || size == 0 || ptr == NULL)
+  {
+    uint64_t old = idRemove(ptr);
+    record(TRACE_REALLOC, 3, old, idAdd(moved), size);
+  }
+  pthread_mutex_unlock(&traceLock);
+  return moved;
+}
+
+/*
+ * \brief alignedAlloc
+ *
+ * Serves and records the three aligned allocation calls.
+ *
+ * \return memory aligned to alignment, or NULL
+ */
+static void *alignedAlloc(size_t alignment, size_t size)
+{
+  void *ptr = __libc_memalign(alignment, size);
+  if (!traceOff)
+  {
+    pthread_mutex_lock(&traceLock);
+    record(TRACE_MEMALIGN, 3, idAdd(ptr), size, alignment);
+    pthread_mutex_unlock(&traceLock);
+  }
+  return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
+  {
+    return EINVAL;
+  }
+  void *ptr = alignedAlloc(alignment, size);
+  if (ptr == NULL && size != 0)
+  {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)))
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  return alignedAlloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  return alignedAlloc(alignment, size);
+}
+
+void free(void *ptr)
+{
+  if (ptr && !traceOff)
+  {
+    pthread_mutex_lock(&traceLock);
+    uint64_t id = idRemove(ptr);
+    if (id)
+    {
+      record(TRACE_FREE, 1, id, 0, 0);
+    }
+    pthread_mutex_unlock(&traceLock);
+  }
+  __libc_free(ptr);
+}
@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Allocation trace format, written by libtrace.so and read by replay.
+ *
+ * A trace starts with TRACE_MAGIC and is followed by records, each an op
+ * byte and then unsigned LEB128 varints:
+ *
+ *   TRACE_MALLOC   id size
+ *   TRACE_CALLOC   id size       (size is nmemb * size)
+ *   TRACE_REALLOC  old id size   (old 0 for realloc(NULL, size))
+ *   TRACE_MEMALIGN id size alignment
+ *   TRACE_FREE     id
+ *
+ * Objects are numbered from 1 in the order they were allocated, so a
+ * trace does not depend on the addresses the recording run happened to
+ * get.  Id 0 is NULL: a failed allocation or a pointer the recorder never
+ * saw handed out.
+ */
+#define TRACE_MAGIC       "MTRACE1\n"
+#define TRACE_MAGIC_SIZE  8
+
+#define TRACE_MALLOC      'm'
+#define TRACE_CALLOC      'c'
+#define TRACE_REALLOC     'r'
+#define TRACE_FREE        'f'
+#define TRACE_MEMALIGN    'a'    /* posix_memalign, aligned_alloc, memalign */
+
+/*
+ * \brief traceEncode
+ *
+ * \return bytes written to out, at most 10
+ */
+static inline size_t traceEncode(uint8_t *out, uint64_t value)
+{
+  size_t n = 0;
+  while (value >= 0x80)
+  {
+    out[n++] = (uint8_t)(value | 0x80);
+    value = value >> 7;
+  }
+  out[n++] = (uint8_t)value;
+  return n;
+}
+
+/*
+ * \brief traceDecode
+ *
+ * \return the byte after the varint, or NULL if it runs past end
+ */
+static inline const uint8_t *traceDecode(const uint8_t *in,
+                                         const uint8_t *end, uint64_t *value)
+{
+  uint64_t result = 0;
+  for (int shift = 0; in < end && shift < 64; shift += 7)
+  {
+    uint8_t byte = *in++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      *value = result;
+      return in;
+    }
+  }
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Synthetic allocation workload that the bench target records a default
+ * trace from when no trace of a real program is given.  It mixes
+ * short-lived small objects, a long-lived pool that is replaced at
+ * random, calloc'd arrays, buffers grown with realloc and the odd
+ * large block above the mmap threshold.  The sequence is fixed by the
+ * seed, so every recording is the same.
+ */
+#define ROUNDS     200000
+#define POOL       8192
+#define BUFFERS    64
+
+static uint64_t seed = 0x2545F4914F6CDD1Dull;
+
+static uint32_t next(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (uint32_t)seed;
+}
+
+/*
+ * \brief pickSize
+ *
+ * \return a size, mostly small with a long tail
+ */
+static size_t pickSize(void)
+{
+  uint32_t r = next() % 1000;
+  if (r < 700)
+  {
+    return 8 + next() % 120;
+  }
+  if (r < 950)
+  {
+    return 128 + next() % 1920;
+  }
+  if (r < 998)
+  {
+    return 2048 + next() % 30720;
+  }
+  return 128 * 1024 + next() % (384 * 1024);
+}
+
+int main()
+{
+  void *pool[POOL] = { NULL };
+  char *buffers[BUFFERS] = { NULL };
+  size_t lengths[BUFFERS] = { 0 };
+  size_t total = 0;
+
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    /* Temporaries that die straight away */
+    void *scratch = malloc(pickSize());
+    memset(scratch, 0, 8);
+
+    /* Long-lived objects replaced at random */
+    int slot = next() % POOL;
+    free(pool[slot]);
+    if (next() % 8 == 0)
+    {
+      size_t count = 1 + next() % 64;
+      pool[slot] = calloc(count, sizeof(uint64_t));
+    }
+    else
+    {
+      size_t size = pickSize();
+      pool[slot] = malloc(size);
+      memset(pool[slot], round, size < 64 ? size : 64);
+    }
+
+    /* Buffers that grow until they are handed off */
+    int b = next() % BUFFERS;
+    if (lengths[b] > 64 * 1024 || buffers[b] == NULL)
+    {
+      free(buffers[b]);
+      lengths[b] = 16;
+      buffers[b] = malloc(lengths[b]);
+    }
+    else if (next() % 4 == 0)
+    {
+      lengths[b] = lengths[b] + lengths[b] / 2;
+      buffers[b] = realloc(buffers[b], lengths[b]);
+    }
+    buffers[b][0] = 'x';
+
+    total += ((char *)scratch)[0];
+    free(scratch);
+  }
+
+  for (int i = 0; i < POOL; i++)
+  {
+    free(pool[i]);
+  }
+  for (int i = 0; i < BUFFERS; i++)
+  {
+    free(buffers[i]);
+  }
+  printf("workload: %d rounds done (%zu)\n", ROUNDS, total);
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+
+/*
+ * Allocation event log, written by malloc.c when MALLOC_EVENTS names a
+ * file and turned into a Chrome trace by bench/events.
+ *
+ * The file is EVENTS_MAGIC followed by struct _event records in the
+ * order they were flushed: in time order per thread, but with threads
+ * interleaved a buffer at a time.  Timestamps are in ticks of the time
+ * stamp counter; EVENT_CLOCK records pair a tick count with
+ * CLOCK_MONOTONIC nanoseconds so a reader can convert them.
+ *
+ *   type            a               b               c
+ *   EVENT_MALLOC    pointer         size
+ *   EVENT_CALLOC    pointer         size
+ *   EVENT_REALLOC   new pointer     size            old pointer
+ *   EVENT_FREE      pointer
+ *   EVENT_GROW      new space       bytes
+ *   EVENT_SPLIT     _block          its size        remainder size
+ *   EVENT_COALESCE  _block          merged size
+ *   EVENT_CLOCK     nanoseconds
+ *   EVENT_DROPPED   events lost because the thread's buffer was full
+ *
+ * Calls into the allocator carry their duration in ticks; the others
+ * are instants and happen during the call that precedes them.
+ */
+#define EVENTS_MAGIC      "MEVENTS1"
+#define EVENTS_MAGIC_SIZE 8
+
+#define EVENT_MALLOC      1
+#define EVENT_CALLOC      2
+#define EVENT_REALLOC     3
+#define EVENT_FREE        4
+#define EVENT_GROW        5
+#define EVENT_SPLIT       6
+#define EVENT_COALESCE    7
+#define EVENT_CLOCK       8
+#define EVENT_DROPPED     9
+
+struct _event
+{
+   uint64_t tsc;         /* When it started */
+   uint32_t duration;    /* Ticks, saturated; 0 for instants */
+   uint32_t tid;
+   uint8_t  type;        /* EVENT_* */
+   uint8_t  arena;
+   uint8_t  pad[6];
+   uint64_t a;
+   uint64_t b;
+   uint64_t c;
+};
+
+#endif
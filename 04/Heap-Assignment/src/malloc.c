@@ -1,400 +1,4679 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-#define ALIGN4(s)         (((((s) - 1) >> 2) << 2) + 4)
+#include "events.h"
+
+/*
+ * Every pointer handed out is ALIGNMENT aligned, except the slots of
+ * the smallest slab class, which only ever hold objects of 8 bytes or
+ * less.  A _block header is one word, so a _block starts 8 bytes before
+ * an ALIGNMENT boundary and header plus payload is always a multiple of
+ * ALIGNMENT; ALIGN_PAYLOAD rounds a request up to such a payload.
+ */
+#define ALIGNMENT         16
+#define ALIGN_PAYLOAD(s)  ((((s) + sizeof(struct _block) + ALIGNMENT - 1) & \
+                            ~(size_t)(ALIGNMENT - 1)) - sizeof(struct _block))
 #define BLOCK_DATA(b)      ((b) + 1)
 #define BLOCK_HEADER(ptr)   ((struct _block *)(ptr) - 1)
+#define BLOCK_END(b)       ((char *)BLOCK_DATA(b) + BLOCK_SIZE(b))
+
+
+static int heapState         = 0;  /* 0 new, 1 initializing, 2 ready */
+static uint64_t num_mmaps    = 0;  /* Updated atomically, no arena lock */
+
+/*
+ * Requests of at least mmapThreshold bytes get a private mapping of their
+ * own instead of arena memory.  free() unmaps it at once, and realloc()
+ * resizes it with mremap(), so neither the data segment nor RSS stays
+ * inflated after a burst of large buffers.  Tunable with the
+ * MALLOC_MMAP_THRESHOLD environment variable or mallopt(M_MMAP_THRESHOLD).
+ */
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+static size_t mmapThreshold  = DEFAULT_MMAP_THRESHOLD;
+
+/*
+ * Free memory is handed back to the kernel once a free _block reaches
+ * trimThreshold bytes.  A top _block that ends at the program break is
+ * shrunk with a negative sbrk(); any other free _block keeps its header
+ * and links but has the whole pages inside it dropped with
+ * madvise(MADV_DONTNEED).  Tunable with the MALLOC_TRIM_THRESHOLD
+ * environment variable or mallopt(M_TRIM_THRESHOLD), and malloc_trim()
+ * forces a trim of every arena.
+ */
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+
+static size_t trimThreshold  = DEFAULT_TRIM_THRESHOLD;
+static size_t pageSize       = 4096;
+
+/*
+ * With MALLOC_HUGEPAGE=1 each arena grows through a range of its own
+ * instead of sbrk().  The range starts on a huge page boundary, is marked
+ * madvise(MADV_HUGEPAGE) and is made accessible a whole huge page at a
+ * time, so the kernel can back the heap with transparent huge pages.  The
+ * slab range is aligned, marked and committed the same way, which keeps
+ * the small-object slabs packed into as few huge pages as possible.
+ */
+#define HUGE_PAGE         ((size_t)2 << 20)
+#define HUGE_REGION       ((size_t)64 << 30)  /* Address space per arena */
+
+static bool hugePages        = false;
+
+/*
+ * A _block header is a single word.  The payload size is a multiple of 8,
+ * so its low bits hold flags, and the top byte holds the index of the
+ * owning arena.  The next _block always starts right after the payload.
+ * A free _block also repeats its size in a footer, the last word of its
+ * payload, so the _block after it can find its start: when the
+ * PREV_FREE flag is set, the word in front of a header is that footer.
+ * Allocated _blocks have no footer and use that word for data.
+ *
+ * Every stretch of memory an arena gets from sbrk() ends in a fencepost,
+ * a header of size 0 that is never free, so coalescing stops there.  It
+ * takes FENCE_SIZE bytes to keep the next stretch aligned.
+ */
+struct _block
+{
+   size_t  head;         /* Payload size | arena << ARENA_SHIFT | flags */
+};
+
+#define BLOCK_FREE        1      /* This _block is free                */
+#define BLOCK_PREV_FREE   2      /* The _block in front of it is free  */
+#define BLOCK_MMAPPED     4      /* Backed by its own mapping          */
+#define BLOCK_ZEROED      ((size_t)1 << 63)  /* Free payload reads zero  */
+#define ARENA_SHIFT       56
+#define SIZE_MASK         ((((size_t)1 << ARENA_SHIFT) - 1) & ~(size_t)7)
+
+#define BLOCK_SIZE(b)      ((b)->head & SIZE_MASK)
+#define BLOCK_ARENA(b)     ((int)((b)->head >> ARENA_SHIFT) & (MAX_ARENAS - 1))
+#define IS_FREE(b)         (((b)->head & BLOCK_FREE) != 0)
+#define IS_PREV_FREE(b)    (((b)->head & BLOCK_PREV_FREE) != 0)
+#define IS_MMAPPED(b)      (((b)->head & BLOCK_MMAPPED) != 0)
+#define IS_ZEROED(b)       (((b)->head & BLOCK_ZEROED) != 0)
+#define SET_SIZE(b, s)     ((b)->head = ((b)->head & ~SIZE_MASK) | (s))
+#define BLOCK_NEXT(b)      ((struct _block *)BLOCK_END(b))
+#define BLOCK_FOOTER(b)    (((size_t *)BLOCK_END(b))[-1])
+#define BLOCK_PREV(b)      ((struct _block *)((char *)(b) - \
+                            ((size_t *)(b))[-1] - sizeof(struct _block)))
+
+/* Largest request whose size still fits the header */
+#define MAX_REQUEST       (SIZE_MASK - 4096)
+
+/*
+ * Free _blocks are threaded onto an explicit free list for their size
+ * class, so searches never touch an allocated _block.  The links live in
+ * the first bytes of the (unused) payload, so a free _block must always
+ * have room for them and its footer.
+ */
+struct _freeLinks
+{
+   struct _block *prevFree;  /* Previous free _block in the same size class */
+   struct _block *nextFree;  /* Next free _block in the same size class     */
+};
+
+#define FREE_LINKS(b)      ((struct _freeLinks *)BLOCK_DATA(b))
+#define MIN_PAYLOAD        (sizeof(struct _freeLinks) + sizeof(size_t))
+#define FENCE_SIZE         ALIGNMENT
+
+/*
+ * Size classes.  Payloads below SMALL_LIMIT get an exact class every
+ * 8 bytes, so any _block in a small bin fits any request mapped to it.
+ * Larger payloads are binned by power of two and need a short scan.
+ */
+#define NUM_SMALL_BINS    64
+#define SMALL_LIMIT       (NUM_SMALL_BINS << 3)
+#define NUM_LARGE_BINS    64
+#define NUM_BINS          (NUM_SMALL_BINS + NUM_LARGE_BINS)
+#define SMALL_LIMIT_LOG2  9
+
+/*
+ * Quick lists.  Frees below QUICK_LIMIT that reach an arena are pushed
+ * onto a list for their exact size class without being coalesced, still
+ * marked in use, and handed straight back by the next malloc of that
+ * size.  They are merged into the heap proper when a large request or a
+ * request that would grow the heap misses, and by malloc_trim().
+ */
+#define QUICK_LIMIT       128
+#define NUM_QUICK         (QUICK_LIMIT >> 3)
+
+/*
+ * Fit policies.  One library holds all of them and the one in use is
+ * picked at startup from MALLOC_FIT=first|next|best|worst|adaptive, then
+ * called through a pointer in each arena, so the choice costs nothing per
+ * call.  The libraries built with -DFIT=0, -DNEXT=0, -DBEST=0 or
+ * -DWORST=0 only change the default.  The adaptive policy starts out as
+ * first fit and reviews each arena every ADAPT_INTERVAL searches: when
+ * more than a quarter of the heap sits in free _blocks, or searches visit
+ * more than ADAPT_SEARCH _blocks on average, the arena moves to best fit,
+ * and it moves back once less than an eighth of the heap is free.
+ */
+#define FIT_FIRST         0
+#define FIT_NEXT          1
+#define FIT_BEST          2
+#define FIT_WORST         3
+#define FIT_ADAPTIVE      4
+
+#if defined NEXT && NEXT == 0
+#define DEFAULT_FIT       FIT_NEXT
+#define DEFAULT_FIND      nextFit
+#elif defined BEST && BEST == 0
+#define DEFAULT_FIT       FIT_BEST
+#define DEFAULT_FIND      bestFit
+#elif defined WORST && WORST == 0
+#define DEFAULT_FIT       FIT_WORST
+#define DEFAULT_FIND      worstFit
+#else
+#define DEFAULT_FIT       FIT_FIRST
+#define DEFAULT_FIND      firstFit
+#endif
+
+#define ADAPT_INTERVAL    1024
+#define ADAPT_SEARCH      8
+#define FIT_SCAN          8     /* Own class _blocks first fit looks at */
+
+static int fitPolicy = DEFAULT_FIT;
+
+/*
+ * Order of the _blocks on each class list.  LIFO pushes a freed _block at
+ * the head, so free() is O(1) and recently used memory is reused first.
+ * ADDRESS keeps each list sorted by address, so first fit really returns
+ * the lowest fitting _block, at the cost of an insert that walks the
+ * class, which is quadratic when many _blocks of one class are freed out
+ * of order.  LIFO is the default for every policy; build with
+ * -DFREE_ORDER=ADDRESS to opt in.
+ */
+#define LIFO              1
+#define ADDRESS           2
+#ifndef FREE_ORDER
+#define FREE_ORDER        LIFO
+#endif
+#if FREE_ORDER != LIFO && FREE_ORDER != ADDRESS
+#error "FREE_ORDER must be LIFO or ADDRESS"
+#endif
+static int freeOrder = FREE_ORDER;
+
+/*
+ * Requests of up to SLAB_LIMIT bytes do not get a _block at all.  They
+ * are served from slabs: SLAB_SIZE byte pages cut into headerless slots
+ * of one size class, an 8 byte class and then one every ALIGNMENT bytes.
+ * A small _slab header at the start of
+ * the page keeps a bitmap with a set bit for every free slot, so finding
+ * a slot is a count-trailing-zeros, and the _slab of any slot is found by
+ * masking its address.  Slabs are carved from one address range reserved
+ * at startup, which also tells free() whether a pointer is a slot.  Each
+ * arena keeps a list per class of its slabs that still have a free slot.
+ * A slab that empties goes to a shared stack for reuse by any class.
+ */
+#define SLAB_SIZE         4096
+#define SLAB_LIMIT        64
+#define SLAB_CLASSES      (SLAB_LIMIT / ALIGNMENT + 1)
+#define SLAB_WORDS        8      /* Bitmap words, enough for 8 byte slots */
+#define SLAB_REGION       ((size_t)1 << 30)  /* Address space for slabs */
+#define SLAB_COMMIT       (64 * SLAB_SIZE)   /* Made accessible at a time */
+
+struct _slab
+{
+   struct _slab *prevSlab;       /* Neighbours on the arena's class list */
+   struct _slab *nextSlab;
+   uint64_t bitmap[SLAB_WORDS];  /* Set bit for every free slot          */
+   unsigned short size;          /* Slot size in bytes                   */
+   unsigned short slots;         /* Number of slots in the slab          */
+   unsigned short used;          /* Slots handed out                     */
+   unsigned char cls;            /* Slab class                           */
+   unsigned char arena;          /* Index of the arena that owns it      */
+   bool   listed;                /* On the arena's class list            */
+};
+
+#define SLAB_SLOTS        ((sizeof(struct _slab) + 15) & ~(size_t)15)
+#define SLAB_OF(ptr)      ((struct _slab *)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+static char *slabBase       = NULL;  /* Reserved range, NULL if disabled */
+static size_t slabCommitted = 0;     /* Bytes of it made accessible      */
+static size_t slabCommit    = SLAB_COMMIT;  /* Bytes committed at a time */
+static size_t slabCarved    = 0;     /* Bytes of it handed to arenas     */
+static struct _slab *emptySlabs = NULL;
+static int num_slabs        = 0;
+static pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * \brief slabClass
+ *
+ * \return the slab class for a request of 1 to SLAB_LIMIT bytes
+ */
+static inline int slabClass(size_t size)
+{
+  return size <= 8 ? 0 : (int)((size + ALIGNMENT - 1) / ALIGNMENT);
+}
+
+/*
+ * \brief isSlot
+ *
+ * \return true if ptr points into the slab range
+ */
+static inline bool isSlot(const void *ptr)
+{
+  return slabBase && (uintptr_t)ptr - (uintptr_t)slabBase < SLAB_REGION;
+}
+
+/*
+ * The heap is split into independent arenas, each with its own memory,
+ * free structures, statistics and lock.  A thread binds to one
+ * arena on its first allocation, either by the CPU it is running on or
+ * round-robin (MALLOC_ARENA_POLICY=cpu|rr), and allocates only from it.
+ * free() returns a _block to the arena recorded in its header.  The
+ * number of arenas defaults to the number of online CPUs and can be set
+ * with MALLOC_ARENAS.  All arenas grow through sbrk() under sbrkLock,
+ * unless huge pages give each its own range.
+ *
+ * A thread freeing a _block that belongs to another arena does not take
+ * that arena's lock.  It pushes the _block onto the arena's remoteFrees
+ * stack with a single compare-and-swap, linked through nextFree, and the
+ * arena drains the whole stack in one exchange the next time it allocates
+ * under its lock.  Since the consumer always takes every entry at once,
+ * the stack needs no ABA protection.
+ */
+#define MAX_ARENAS        64
+
+/*
+ * The heap grows in chunks rather than by exactly what a request needs.
+ * Each arena starts at MIN_GROW and doubles its chunk on every grow up to
+ * MAX_GROW.  The unused end of the newest chunk is the arena's top
+ * _block: it is free but kept off the free lists, is only cut from when
+ * no free _block fits, and absorbs any _block freed next to it.
+ */
+#define MIN_GROW          (64 * 1024)
+#define MAX_GROW          (16 * 1024 * 1024)
+
+struct _arena;
+typedef struct _block *(*fitFunc)(struct _arena *a, size_t size);
+
+static struct _block *firstFit(struct _arena *a, size_t size);
+static struct _block *nextFit(struct _arena *a, size_t size);
+static struct _block *bestFit(struct _arena *a, size_t size);
+static struct _block *worstFit(struct _arena *a, size_t size);
+static struct _block *adaptiveFit(struct _arena *a, size_t size);
+
+struct _arena
+{
+   pthread_mutex_t lock;
+   fitFunc find;                       /* Fit policy called by heapAlloc  */
+   fitFunc fit;                        /* Policy the adaptive one uses    */
+   int adaptCountdown;                 /* Searches left until a review    */
+   uint64_t searches;                  /* Searches since the last review  */
+   uint64_t searched;                  /* _blocks they visited            */
+   size_t free_bytes;                  /* Payload bytes on the free lists */
+   struct _block *top;                 /* Free space at the end, unbinned */
+   char *hugeBase;                     /* Huge page range, NULL if none   */
+   char *hugeBrk;                      /* End of its used part            */
+   char *hugeCommitted;                /* End of its accessible part      */
+   char *topClean;                     /* Top reads zero from here on     */
+   size_t growSize;                    /* Bytes to ask sbrk() for next    */
+   struct _block *bins[NUM_BINS];      /* Circular free list per class    */
+   uint64_t binMap[NUM_BINS / 64];     /* Bit set for each non-empty bin  */
+   struct _block *sizeTree;            /* Root of the large free _blocks  */
+   struct _block *remoteFrees;         /* Lock-free stack of foreign frees */
+   struct _slab *slabs[SLAB_CLASSES];  /* Slabs with a free slot, by class */
+   struct _block *quick[NUM_QUICK];    /* Unmerged frees, by size class   */
+   int quickCount;                     /* _blocks on the quick lists      */
+
+   uint64_t num_mallocs;
+   uint64_t num_frees;
+   uint64_t num_reuses;
+   uint64_t num_grows;
+   uint64_t num_splits;
+   uint64_t num_coalesces;
+   uint64_t num_blocks;
+   uint64_t num_requested;
+   uint64_t num_remote_frees;
+   uint64_t num_trims;
+   uint64_t num_quick_hits;
+   uint64_t num_searches;              /* Searches before the last review */
+   uint64_t num_searched;
+   size_t max_heap;
+   size_t heap_size;                   /* Bytes currently taken by sbrk() */
+};
+
+#define ARENA_CPU         0
+#define ARENA_ROUND_ROBIN 1
+
+static struct _arena arenas[MAX_ARENAS] =
+{
+   [0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                              .find = DEFAULT_FIND,
+                              .fit = firstFit,
+                              .adaptCountdown = ADAPT_INTERVAL,
+                              .growSize = MIN_GROW }
+};
+static int numArenas   = 1;
+static int arenaPolicy = ARENA_CPU;
+static int nextArena   = 0;            /* Round-robin cursor              */
+static pthread_mutex_t sbrkLock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct _arena *threadArena
+   __attribute__((tls_model("initial-exec")));
+
+/*
+ * Statistics.  Arena counters are kept under the arena's lock and thread
+ * counters lock-free in each thread's cache; statsCollect() adds them
+ * all up on demand, together with a walk of every arena's free lists for
+ * the fragmentation figures.  The snapshot is available field by field
+ * through mallctl() and in full as JSON or CSV through
+ * malloc_stats_dump().
+ */
+#define STAT_SIZES        64     /* Request histogram buckets, by log2 */
+
+struct _stats
+{
+   uint64_t mallocs;
+   uint64_t frees;
+   uint64_t reuses;
+   uint64_t grows;
+   uint64_t splits;
+   uint64_t coalesces;
+   uint64_t requested;
+   uint64_t remote_frees;
+   uint64_t mmaps;
+   uint64_t trims;
+   uint64_t quick_hits;
+   uint64_t slabs;
+   uint64_t heap_size;
+   uint64_t max_heap;
+   uint64_t huge_bytes;                /* Backed by transparent huge pages */
+   uint64_t free_blocks;               /* _blocks on the free lists       */
+   uint64_t free_bytes;                /* Their payload plus the tops     */
+   uint64_t largest_free;              /* Largest of those, or a top      */
+   uint64_t searches;                  /* findFreeBlock() calls           */
+   uint64_t searched;                  /* _blocks they visited            */
+   double fragmentation;               /* 1 - largest_free / free_bytes   */
+   double search_length;               /* searched / searches             */
+   uint64_t request_sizes[STAT_SIZES]; /* Requests of 2^i to 2^(i+1)-1    */
+   uint64_t free_classes[NUM_BINS];    /* Free _blocks by size class      */
+};
+
+static void drainRemoteFrees(struct _arena *a);
+static void quickConsolidate(struct _arena *a);
+static size_t hugeBacked(void);
+static void statsCollect(struct _stats *st);
+static void statsPrintf(char *buf, size_t size, size_t *len,
+                        const char *format, ...);
+static void statsWrite(int fd, const char *buf, size_t len);
+static const char *statsFile = NULL;   /* MALLOC_STATS_FILE, dumped at exit */
+int malloc_stats_dump(const char *path);
+static void profileAtExit(void);
+static void eventsAtExit(void);
+
+/*
+ *  \brief printStatistics
+ *
+ *  \param none
+ *
+ *  Prints the heap statistics upon process exit, summed over all
+ *  arenas and threads.  Registered via atexit().  The report is built
+ *  in a local buffer and written with write(), so printing cannot call
+ *  back into malloc().  Also dumps the full statistics to the file named
+ *  by MALLOC_STATS_FILE, if set, and the heap profile if profiling, and
+ *  flushes the event trace if tracing.
+ *
+ *  \return none
+ */
+void printStatistics( void )
+{
+  for (int i = 0; i < numArenas; i++)
+  {
+    struct _arena *a = &arenas[i];
+    pthread_mutex_lock( &a->lock );
+    drainRemoteFrees( a );
+    quickConsolidate( a );
+    pthread_mutex_unlock( &a->lock );
+  }
+  struct _stats st;
+  statsCollect( &st );
+
+  char buf[1024];
+  size_t len = 0;
+  statsPrintf( buf, sizeof(buf), &len, "\nheap management statistics\n" );
+  statsPrintf( buf, sizeof(buf), &len, "mallocs:\t%" PRIu64 "\n", st.mallocs );
+  statsPrintf( buf, sizeof(buf), &len, "frees:\t\t%" PRIu64 "\n", st.frees );
+  statsPrintf( buf, sizeof(buf), &len, "reuses:\t\t%" PRIu64 "\n", st.reuses );
+  statsPrintf( buf, sizeof(buf), &len, "grows:\t\t%" PRIu64 "\n", st.grows );
+  statsPrintf( buf, sizeof(buf), &len, "splits:\t\t%" PRIu64 "\n", st.splits );
+  statsPrintf( buf, sizeof(buf), &len, "coalesces:\t%" PRIu64 "\n", st.coalesces );
+  statsPrintf( buf, sizeof(buf), &len, "blocks:\t\t%" PRIu64 "\n", st.free_blocks );
+  statsPrintf( buf, sizeof(buf), &len, "requested:\t%" PRIu64 "\n", st.requested );
+  statsPrintf( buf, sizeof(buf), &len, "remote frees:\t%" PRIu64 "\n", st.remote_frees );
+  statsPrintf( buf, sizeof(buf), &len, "mmaps:\t\t%" PRIu64 "\n", st.mmaps );
+  statsPrintf( buf, sizeof(buf), &len, "trims:\t\t%" PRIu64 "\n", st.trims );
+  statsPrintf( buf, sizeof(buf), &len, "quick hits:\t%" PRIu64 "\n", st.quick_hits );
+  statsPrintf( buf, sizeof(buf), &len, "slabs:\t\t%" PRIu64 "\n", st.slabs );
+  statsPrintf( buf, sizeof(buf), &len, "huge pages:\t%" PRIu64 "\n", st.huge_bytes / HUGE_PAGE );
+  statsPrintf( buf, sizeof(buf), &len, "max heap:\t%" PRIu64 "\n", st.max_heap );
+
+  /* Anything printf() still holds goes out first */
+  fflush( stdout );
+  statsWrite( STDOUT_FILENO, buf, len );
+
+  if (statsFile)
+  {
+    malloc_stats_dump( statsFile );
+  }
+  profileAtExit();
+  eventsAtExit();
+}
+
+/*
+ * \brief sizeToBin
+ *
+ * Maps a payload size to the index of the size class that holds it.
+ *
+ * \param size payload size in bytes
+ *
+ * \return bin index in [0, NUM_BINS)
+ */
+static inline int sizeToBin(size_t size)
+{
+  if (size < SMALL_LIMIT)
+  {
+    return (int)(size >> 3);
+  }
+  int bin = NUM_SMALL_BINS + (63 - __builtin_clzll(size)) - SMALL_LIMIT_LOG2;
+  return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+/*
+ * \brief nextNonEmptyBin
+ *
+ * \param a arena to search
+ * \param bin first bin index to consider
+ *
+ * \return index of the first non-empty bin >= bin, or -1 if there is none
+ */
+static inline int nextNonEmptyBin(struct _arena *a, int bin)
+{
+  int word = bin >> 6;
+  if (word >= NUM_BINS / 64)
+  {
+    return -1;
+  }
+  uint64_t bits = a->binMap[word] & (~0ULL << (bin & 63));
+  while (bits == 0)
+  {
+    if (++word == NUM_BINS / 64)
+    {
+      return -1;
+    }
+    bits = a->binMap[word];
+  }
+  return (word << 6) + __builtin_ctzll(bits);
+}
+
+/*
+ * \brief highestNonEmptyBin
+ *
+ * \param a arena to search
+ *
+ * \return index of the last non-empty bin, or -1 if every bin is empty
+ */
+static inline int highestNonEmptyBin(struct _arena *a)
+{
+  for (int word = NUM_BINS / 64 - 1; word >= 0; word--)
+  {
+    if (a->binMap[word])
+    {
+      return (word << 6) + 63 - __builtin_clzll(a->binMap[word]);
+    }
+  }
+  return -1;
+}
+
+/*
+ * Free _blocks of SMALL_LIMIT bytes or more are also kept in a treap
+ * ordered by (size, address), which answers the best fit (lower bound)
+ * and worst fit (maximum) queries in O(log n) expected time no matter how
+ * many large free _blocks there are.  Node priorities are a hash of the
+ * _block address, so no extra state is stored.  The tree links follow the
+ * free links in the payload.
+ */
+struct _treeLinks
+{
+   struct _block *left;    /* Smaller (size, address) keys */
+   struct _block *right;   /* Larger (size, address) keys  */
+   struct _block *parent;
+};
+
+#define TREE_LINKS(b)      ((struct _treeLinks *)(FREE_LINKS(b) + 1))
+
+static inline bool treeLess(struct _block *a, struct _block *b)
+{
+  return BLOCK_SIZE(a) < BLOCK_SIZE(b) ||
+         (BLOCK_SIZE(a) == BLOCK_SIZE(b) && a < b);
+}
+
+static inline uint64_t treePriority(struct _block *b)
+{
+  return (uint64_t)(uintptr_t)b * 0x9E3779B97F4A7C15ULL;
+}
+
+/*
+ * \brief treeReplaceChild
+ *
+ * Points whatever referenced old (its parent's child link or the root)
+ * at new instead.
+ */
+static inline void treeReplaceChild(struct _arena *a, struct _block *parent,
+                                    struct _block *old, struct _block *new)
+{
+  if (parent == NULL)
+  {
+    a->sizeTree = new;
+  }
+  else if (TREE_LINKS(parent)->left == old)
+  {
+    TREE_LINKS(parent)->left = new;
+  }
+  else
+  {
+    TREE_LINKS(parent)->right = new;
+  }
+  if (new)
+  {
+    TREE_LINKS(new)->parent = parent;
+  }
+}
+
+/*
+ * \brief treeRotateUp
+ *
+ * Rotates child x above its parent, preserving the key order.
+ */
+static void treeRotateUp(struct _arena *a, struct _block *x)
+{
+  struct _block *p = TREE_LINKS(x)->parent;
+  treeReplaceChild(a, TREE_LINKS(p)->parent, p, x);
+  if (TREE_LINKS(p)->left == x)
+  {
+    TREE_LINKS(p)->left = TREE_LINKS(x)->right;
+    if (TREE_LINKS(p)->left)
+    {
+      TREE_LINKS(TREE_LINKS(p)->left)->parent = p;
+    }
+    TREE_LINKS(x)->right = p;
+  }
+  else
+  {
+    TREE_LINKS(p)->right = TREE_LINKS(x)->left;
+    if (TREE_LINKS(p)->right)
+    {
+      TREE_LINKS(TREE_LINKS(p)->right)->parent = p;
+    }
+    TREE_LINKS(x)->left = p;
+  }
+  TREE_LINKS(p)->parent = x;
+}
+
+/*
+ * \brief treeInsert
+ *
+ * Adds a free _block to the arena's size tree.
+ */
+static void treeInsert(struct _arena *a, struct _block *b)
+{
+  struct _block *parent = NULL;
+  struct _block **link = &a->sizeTree;
+  while (*link)
+  {
+    parent = *link;
+    link = treeLess(b, parent) ? &TREE_LINKS(parent)->left
+                               : &TREE_LINKS(parent)->right;
+  }
+  TREE_LINKS(b)->left = NULL;
+  TREE_LINKS(b)->right = NULL;
+  TREE_LINKS(b)->parent = parent;
+  *link = b;
+
+  while (TREE_LINKS(b)->parent &&
+         treePriority(b) > treePriority(TREE_LINKS(b)->parent))
+  {
+    treeRotateUp(a, b);
+  }
+}
+
+/*
+ * \brief treeRemove
+ *
+ * Removes a _block from the arena's size tree by rotating it down to a
+ * leaf.
+ */
+static void treeRemove(struct _arena *a, struct _block *b)
+{
+  for (;;)
+  {
+    struct _block *l = TREE_LINKS(b)->left;
+    struct _block *r = TREE_LINKS(b)->right;
+    if (l == NULL || r == NULL)
+    {
+      treeReplaceChild(a, TREE_LINKS(b)->parent, b, l ? l : r);
+      return;
+    }
+    treeRotateUp(a, treePriority(l) > treePriority(r) ? l : r);
+  }
+}
+
+/*
+ * \brief treeLowerBound
+ *
+ * \return the smallest (lowest addressed among equals) _block in the tree
+ * with at least size bytes, or NULL
+ */
+static inline struct _block *treeLowerBound(struct _arena *a, size_t size)
+{
+  struct _block *node = a->sizeTree;
+  struct _block *best = NULL;
+  while (node)
+  {
+    if (BLOCK_SIZE(node) >= size)
+    {
+      best = node;
+      node = TREE_LINKS(node)->left;
+    }
+    else
+    {
+      node = TREE_LINKS(node)->right;
+    }
+  }
+  return best;
+}
+
+/*
+ * \brief treeMax
+ *
+ * \return the largest _block in the tree, or NULL if it is empty
+ */
+static inline struct _block *treeMax(struct _arena *a)
+{
+  struct _block *node = a->sizeTree;
+  while (node && TREE_LINKS(node)->right)
+  {
+    node = TREE_LINKS(node)->right;
+  }
+  return node;
+}
+
+/*
+ * \brief insertFree
+ *
+ * Links a free _block onto the list for its size class, and into the size
+ * tree if it is a large _block.  With LIFO order it becomes the new head;
+ * with ADDRESS order it is placed between its address-order neighbours,
+ * and becomes the head if it is the lowest.
+ *
+ * \param a arena that owns the _block
+ * \param b the _block to insert
+ *
+ * \return none
+ */
+static void insertFree(struct _arena *a, struct _block *b)
+{
+  int bin = sizeToBin(BLOCK_SIZE(b));
+  struct _block *head = a->bins[bin];
+  a->free_bytes += BLOCK_SIZE(b);
+  if (bin >= NUM_SMALL_BINS)
+  {
+    treeInsert(a, b);
+  }
+  if (head == NULL)
+  {
+    FREE_LINKS(b)->prevFree = b;
+    FREE_LINKS(b)->nextFree = b;
+    a->binMap[bin >> 6] |= 1ULL << (bin & 63);
+    a->bins[bin] = b;
+    return;
+  }
 
+  /* Insert in front of succ, which for LIFO is the current head */
+  struct _block *succ = head;
+  if (freeOrder == ADDRESS)
+  {
+    /* The list is sorted circularly, so the spot is either between two
+       ascending neighbours or on the wrap-around edge from max to min */
+    struct _block *pred = FREE_LINKS(succ)->prevFree;
+    while (!((pred < b && b < succ) ||
+             (pred >= succ && (b > pred || b < succ))))
+    {
+      pred = succ;
+      succ = FREE_LINKS(succ)->nextFree;
+    }
+  }
+  struct _block *tail = FREE_LINKS(succ)->prevFree;
+  FREE_LINKS(b)->prevFree = tail;
+  FREE_LINKS(b)->nextFree = succ;
+  FREE_LINKS(tail)->nextFree = b;
+  FREE_LINKS(succ)->prevFree = b;
+  /* Next fit keeps its rover at the head, so b is visited last */
+  if (a->find != nextFit && (freeOrder == LIFO || b < head))
+  {
+    a->bins[bin] = b;
+  }
+}
 
-static int atexit_registered = 0;
-static int num_mallocs       = 0;
-static int num_frees         = 0;
-static int num_reuses        = 0;
-static int num_grows         = 0;
-static int num_splits        = 0;
-static int num_coalesces     = 0;
-static int num_blocks        = 0;
-static int num_requested     = 0;
-static int max_heap          = 0;
+/*
+ * \brief removeFree
+ *
+ * Unlinks a free _block from its size class list and the size tree.
+ * Must be called before the _block's size changes or it is handed out.
+ *
+ * \param a arena that owns the _block
+ * \param b the _block to remove
+ *
+ * \return none
+ */
+static void removeFree(struct _arena *a, struct _block *b)
+{
+  int bin = sizeToBin(BLOCK_SIZE(b));
+  struct _block *next = FREE_LINKS(b)->nextFree;
+  a->free_bytes -= BLOCK_SIZE(b);
+  if (bin >= NUM_SMALL_BINS)
+  {
+    treeRemove(a, b);
+  }
+  if (next == b)
+  {
+    a->bins[bin] = NULL;
+    a->binMap[bin >> 6] &= ~(1ULL << (bin & 63));
+    return;
+  }
+  struct _block *prev = FREE_LINKS(b)->prevFree;
+  FREE_LINKS(prev)->nextFree = next;
+  FREE_LINKS(next)->prevFree = prev;
+  if (a->bins[bin] == b)
+  {
+    a->bins[bin] = next;
+  }
+}
+
+/*
+ * The fit policies below search the size-class lists for a free _block.
+ * Every class above the one the request maps to is known to fit, so
+ * first and next fit look at no more than FIT_SCAN _blocks of the
+ * request's own class before taking the head of the next non-empty
+ * class, and fall back on the size tree for the rest of their own class.
+ * Best and worst fit query the size tree for large _blocks.  Each takes
+ * the arena to search and the payload size needed, and returns a _block
+ * that fits, still linked on its free list, or NULL if no free _block
+ * matches.
+ */
+
+/*
+ * \brief firstFit
+ *
+ * First _block that fits among the head of the request's own class and
+ * the FIT_SCAN - 1 after it, else the head of the first class above it.
+ */
+static struct _block *firstFit(struct _arena *a, size_t size)
+{
+  int own = sizeToBin(size);
+  unsigned visited = 0;
+  struct _block *b = a->bins[own];
+  while (b && BLOCK_SIZE(b) < size)
+  {
+    b = FREE_LINKS(b)->nextFree;
+    if (++visited == FIT_SCAN || b == a->bins[own])
+    {
+      b = NULL;
+    }
+  }
+  if (b == NULL)
+  {
+    int bin = nextNonEmptyBin(a, own + 1);
+    b = bin >= 0 ? a->bins[bin] : NULL;
+  }
+  if (b == NULL && own >= NUM_SMALL_BINS)
+  {
+    /* Only the unscanned part of the own class can still fit */
+    b = treeLowerBound(a, size);
+  }
+  a->searched += visited + (b != NULL);
+  return b;
+}
+
+/*
+ * \brief nextFit
+ *
+ * Each class list is circular and its head is the rover: it moves on to
+ * the _block after the one last handed out, so the next search resumes
+ * there in O(1).  The search itself is first fit's, which starts at the
+ * heads.  The rover survives the _block it points at being removed,
+ * since removeFree() moves the head on; freed and coalesced _blocks are
+ * linked in behind it, and the remainder of a split becomes the rover of
+ * its class, where classic next fit would resume.
+ */
+static struct _block *nextFit(struct _arena *a, size_t size)
+{
+  struct _block *b = firstFit(a, size);
+  if (b)
+  {
+    a->bins[sizeToBin(BLOCK_SIZE(b))] = FREE_LINKS(b)->nextFree;
+  }
+  return b;
+}
+
+/*
+ * \brief bestFit
+ *
+ * A small class holds _blocks of exactly one size, so the first non-empty
+ * small class at or above the request is the best fit.  Otherwise it is
+ * the lower bound of the request in the size tree.
+ */
+static struct _block *bestFit(struct _arena *a, size_t size)
+{
+  int bin = nextNonEmptyBin(a, sizeToBin(size));
+  a->searched++;
+  if (bin < 0)
+  {
+    return NULL;
+  }
+  if (bin < NUM_SMALL_BINS)
+  {
+    return a->bins[bin];
+  }
+  return treeLowerBound(a, size);
+}
+
+/*
+ * \brief worstFit
+ *
+ * The largest free _block is the size tree maximum, or, when only small
+ * _blocks are free, the head of the highest small class.
+ */
+static struct _block *worstFit(struct _arena *a, size_t size)
+{
+  struct _block *curr = treeMax(a);
+  a->searched++;
+  if (curr == NULL)
+  {
+    int bin = highestNonEmptyBin(a);
+    return bin >= sizeToBin(size) ? a->bins[bin] : NULL;
+  }
+  return BLOCK_SIZE(curr) >= size ? curr : NULL;
+}
+
+/*
+ * \brief adaptiveFit
+ *
+ * Searches with the arena's current policy, reviewing the choice every
+ * ADAPT_INTERVAL searches from the fragmentation and the average number
+ * of _blocks visited since the last review.
+ */
+static struct _block *adaptiveFit(struct _arena *a, size_t size)
+{
+  if (--a->adaptCountdown <= 0)
+  {
+    bool fragmented = a->free_bytes * 4 > a->heap_size;
+    bool slow = a->searched > (unsigned)ADAPT_SEARCH * a->searches;
+    if (a->fit == firstFit && (fragmented || slow))
+    {
+      a->fit = bestFit;
+    }
+    else if (a->fit == bestFit && a->free_bytes * 8 < a->heap_size)
+    {
+      a->fit = firstFit;
+    }
+    a->adaptCountdown = ADAPT_INTERVAL;
+    a->num_searches = a->num_searches + a->searches;
+    a->num_searched = a->num_searched + a->searched;
+    a->searches = 0;
+    a->searched = 0;
+  }
+  return a->fit(a, size);
+}
+
+/*
+ * \brief findFreeBlock
+ *
+ * Runs the arena's fit policy.
+ *
+ * \param a arena to search
+ * \param size size of the _block needed in bytes
+ *
+ * \return a _block that fits the request or NULL if no free _block matches.
+ * The _block is still linked on its free list.
+ */
+static inline struct _block *findFreeBlock(struct _arena *a, size_t size)
+{
+  a->searches++;
+  struct _block *curr = a->find(a, size);
+  if(curr != NULL)
+  {
+    a->num_blocks--;
+  }
+  return curr;
+}
+
+/*
+ * \brief markFree
+ *
+ * Flags b free, writes its footer and tells the next _block about it.
+ *
+ * \return none
+ */
+static inline void markFree(struct _block *b)
+{
+  b->head |= BLOCK_FREE;
+  BLOCK_FOOTER(b) = BLOCK_SIZE(b);
+  BLOCK_NEXT(b)->head |= BLOCK_PREV_FREE;
+}
+
+/*
+ * \brief markUsed
+ *
+ * Flags b in use and tells the next _block about it.  An allocated
+ * _block is never taken to be zero.
+ *
+ * \return none
+ */
+static inline void markUsed(struct _block *b)
+{
+  b->head &= ~(BLOCK_FREE | BLOCK_ZEROED);
+  BLOCK_NEXT(b)->head &= ~(size_t)BLOCK_PREV_FREE;
+}
+
+/*
+ * \brief carveBlock
+ *
+ * Cuts the tail of _block b off into a new free _block when what is left
+ * over after size bytes is big enough to hold a header, the free links
+ * and a footer.  The new _block is not put on a free list.
+ *
+ * \param b _block being cut, not on any free list
+ * \param size payload size b must keep
+ *
+ * \return the new _block or NULL if b was too small to cut
+ */
+static struct _block *carveBlock(struct _block *b, size_t size)
+{
+  size_t total = BLOCK_SIZE(b);
+  if (total < size + sizeof(struct _block) + MIN_PAYLOAD)
+  {
+    return NULL;
+  }
+  SET_SIZE(b, size);
+  struct _block *temp = BLOCK_NEXT(b);
+  temp->head = (b->head & ~(SIZE_MASK | BLOCK_PREV_FREE | BLOCK_MMAPPED)) |
+               (total - size - sizeof(struct _block));
+  markFree(temp);
+  return temp;
+}
+
+/*
+ * \brief reserveAligned
+ *
+ * Reserves size bytes of address space, inaccessible until mprotect()ed,
+ * starting on a huge page boundary and marked for transparent huge pages.
+ *
+ * \param size bytes to reserve, a multiple of HUGE_PAGE
+ *
+ * \return the range or NULL if it could not be reserved
+ */
+static char *reserveAligned(size_t size)
+{
+  char *range = mmap(NULL, size + HUGE_PAGE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (range == MAP_FAILED)
+  {
+    return NULL;
+  }
+  char *base = (char *)(((uintptr_t)range + HUGE_PAGE - 1) &
+                        ~(HUGE_PAGE - 1));
+  if (base > range)
+  {
+    munmap(range, (size_t)(base - range));
+  }
+  munmap(base + size, (size_t)(range + HUGE_PAGE - base));
+  madvise(base, size, MADV_HUGEPAGE);
+  return base;
+}
+
+/*
+ * \brief hugeReserve
+ *
+ * Reserves the arena's huge page range on its first grow.
+ *
+ * \param a locked arena
+ *
+ * \return true if the arena has a huge page range
+ */
+static bool hugeReserve(struct _arena *a)
+{
+  if (a->hugeBase == NULL)
+  {
+    a->hugeBase = reserveAligned(HUGE_REGION);
+    a->hugeBrk = a->hugeBase;
+    a->hugeCommitted = a->hugeBase;
+  }
+  return a->hugeBase != NULL;
+}
+
+/*
+ * \brief hugeSbrk
+ *
+ * sbrk() for the arena's huge page range.  Growing makes whole huge pages
+ * accessible as needed; shrinking drops the pages past the new break,
+ * which stay accessible for the next grow.
+ *
+ * \param a locked arena with a huge page range
+ * \param increment bytes to move the break by
+ *
+ * \return the old break or (char *)-1 if the range is used up
+ */
+static char *hugeSbrk(struct _arena *a, intptr_t increment)
+{
+  char *old = a->hugeBrk;
+  char *brk = old + increment;
+  if (brk < a->hugeBase || (size_t)(brk - a->hugeBase) > HUGE_REGION)
+  {
+    return (char *)-1;
+  }
+  if (brk > a->hugeCommitted)
+  {
+    char *end = (char *)(((uintptr_t)brk + HUGE_PAGE - 1) &
+                         ~(HUGE_PAGE - 1));
+    if (mprotect(a->hugeCommitted, (size_t)(end - a->hugeCommitted),
+                 PROT_READ | PROT_WRITE))
+    {
+      return (char *)-1;
+    }
+    a->hugeCommitted = end;
+  }
+  else if (increment < 0)
+  {
+    uintptr_t start = ((uintptr_t)brk + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t)old + pageSize - 1) & ~(pageSize - 1);
+    if (end > start)
+    {
+      madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+  }
+  a->hugeBrk = brk;
+  return old;
+}
+
+/*
+ * \brief hugeBacked
+ *
+ * Adds up the transparent huge pages behind the arenas' huge page ranges
+ * and the slab range, as reported by /proc/self/smaps.  Reads the file
+ * with plain system calls so that it can run while the heap is in use.
+ *
+ * \return bytes backed by huge pages
+ */
+static size_t hugeBacked(void)
+{
+  int fd = open("/proc/self/smaps", O_RDONLY);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  char buf[4096];
+  size_t len = 0;
+  size_t total = 0;
+  bool ours = false;
+  ssize_t got;
+  while ((got = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+  {
+    len = len + (size_t)got;
+    buf[len] = '\0';
+    char *line = buf;
+    char *eol;
+    while ((eol = strchr(line, '\n')) != NULL)
+    {
+      *eol = '\0';
+      char *dash;
+      uintptr_t start = (uintptr_t)strtoull(line, &dash, 16);
+      if (dash > line && *dash == '-')
+      {
+        /* A mapping header, "start-end perms ..." */
+        ours = isSlot((void *)start);
+        for (int i = 0; i < numArenas && !ours; i++)
+        {
+          ours = arenas[i].hugeBase &&
+                 start - (uintptr_t)arenas[i].hugeBase < HUGE_REGION;
+        }
+      }
+      else if (ours && strncmp(line, "AnonHugePages:", 14) == 0)
+      {
+        total = total + strtoull(line + 14, NULL, 10) * 1024;
+      }
+      line = eol + 1;
+    }
+    len = (size_t)(buf + len - line);
+    memmove(buf, line, len);
+  }
+  close(fd);
+  return total;
+}
+
+/*
+ * Allocation event tracing, turned on by naming a file in MALLOC_EVENTS.
+ * Every malloc(), calloc(), realloc() and free(), and the heap growth,
+ * splits and coalesces they cause, is stamped with the time stamp
+ * counter and appended to the calling thread's ring of EVENT_RING events.
+ * The owning thread is the only writer and the flush thread the only
+ * reader, so neither takes a lock, and a thread whose ring is full
+ * counts the event as dropped rather than wait.  The flush thread is
+ * started by the first traced call and empties every ring into the file
+ * every EVENT_FLUSH_MS, and once more at exit.  events.h describes the
+ * file.
+ *
+ * A ring outlives its thread and goes to the next thread that needs one
+ * once it has been emptied.  A forked child stops tracing.
+ */
+#define EVENT_RING        (1 << 15)   /* Events per thread, a power of two */
+#define EVENT_FLUSH_MS    10
+
+struct _eventRing
+{
+   uint64_t head;                      /* Written by the owner only       */
+   uint64_t dropped;
+   char     pad[48];                   /* Keep the two sides apart        */
+   uint64_t tail;                      /* Written by the flush thread only */
+   uint64_t reported;                  /* Drops already written out       */
+   struct _eventRing *next;            /* On eventRings, never removed    */
+   int      dead;                      /* Owner has exited                */
+   uint32_t tid;
+   struct _event events[EVENT_RING];
+};
+
+static bool eventsOn       = false;
+static int  eventsFd       = -1;
+static bool eventsWorkerUp = false;
+static struct _eventRing *eventRings = NULL;
+static pthread_mutex_t eventsFlushLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct _eventRing *eventRing
+   __attribute__((tls_model("initial-exec")));
+
+static inline uint64_t eventClock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static void eventsFlush(void);
+
+/*
+ * \brief eventRingClaim
+ *
+ * Gives the calling thread an emptied ring left by a thread that exited,
+ * flushing the rings first if that is all that keeps one from being
+ * reused, or a new one.
+ *
+ * \return the ring, or NULL if there was no memory for one
+ */
+static struct _eventRing *eventRingClaim(void)
+{
+  uint32_t tid = (uint32_t)syscall(SYS_gettid);
+  struct _eventRing *r;
+  for (int pass = 0; pass < 2; pass++)
+  {
+    bool waiting = false;
+    for (r = __atomic_load_n(&eventRings, __ATOMIC_ACQUIRE); r; r = r->next)
+    {
+      int dead = 1;
+      if (!__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE))
+      {
+        continue;
+      }
+      if (r->head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+      {
+        waiting = true;
+        continue;
+      }
+      if (__atomic_compare_exchange_n(&r->dead, &dead, 0, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        r->tid = tid;
+        return eventRing = r;
+      }
+    }
+    if (!waiting)
+    {
+      break;
+    }
+    /* Threads that come and go faster than the flush thread runs would
+       otherwise each map a ring of their own */
+    eventsFlush();
+  }
+
+  r = mmap(NULL, sizeof(struct _eventRing), PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (r == MAP_FAILED)
+  {
+    return NULL;
+  }
+  r->tid = tid;
+  r->next = __atomic_load_n(&eventRings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&eventRings, &r->next, r, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+  {
+  }
+  return eventRing = r;
+}
+
+/*
+ * \brief eventsFlush
+ *
+ * Writes out everything in every ring, after a clock record.
+ *
+ * \return none
+ */
+static void eventsFlush(void)
+{
+  pthread_mutex_lock(&eventsFlushLock);
+  struct timespec now;
+  struct _event clock = { .type = EVENT_CLOCK };
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  clock.tsc = eventClock();
+  clock.a = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+  statsWrite(eventsFd, (const char *)&clock, sizeof(clock));
+
+  for (struct _eventRing *r = __atomic_load_n(&eventRings, __ATOMIC_ACQUIRE);
+       r; r = r->next)
+  {
+    uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->reported)
+    {
+      struct _event lost = { .tsc = clock.tsc, .tid = r->tid,
+                             .type = EVENT_DROPPED,
+                             .a = dropped - r->reported };
+      statsWrite(eventsFd, (const char *)&lost, sizeof(lost));
+      r->reported = dropped;
+    }
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    while (tail != head)
+    {
+      size_t first = tail & (EVENT_RING - 1);
+      size_t count = head - tail < EVENT_RING - first ? head - tail
+                                                      : EVENT_RING - first;
+      statsWrite(eventsFd, (const char *)&r->events[first],
+                 count * sizeof(struct _event));
+      tail = tail + count;
+      __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&eventsFlushLock);
+}
+
+static void *eventsWorker(void *arg)
+{
+  struct timespec interval = { 0, EVENT_FLUSH_MS * 1000000L };
+  for (;;)
+  {
+    nanosleep(&interval, NULL);
+    eventsFlush();
+  }
+  return arg;
+}
+
+static void eventRecord(int type, uint64_t start, uint64_t a, uint64_t b,
+                        uint64_t c, int arena);
+
+/* Start time of a traced call, 0 when not tracing */
+#define EVENT_START()     (__builtin_expect(eventsOn, 0) ? eventClock() : 0)
+
+#define EVENT(type, start, a, b, c, arena)                               \
+  do                                                                     \
+  {                                                                      \
+    if (__builtin_expect(eventsOn, 0))                                   \
+    {                                                                    \
+      eventRecord((type), (start), (uint64_t)(a), (uint64_t)(b),         \
+                  (uint64_t)(c), (arena));                               \
+    }                                                                    \
+  } while (0)
+
+/* A call into the allocator, charged to the calling thread's arena */
+#define EVENT_CALL(type, start, a, b, c)                                 \
+  EVENT((type), (start), (a), (b), (c),                                  \
+        threadArena ? (int)(threadArena - arenas) : 0)
+
+/*
+ * \brief eventsInit
+ *
+ * Opens MALLOC_EVENTS, if set, and starts tracing.  Called from
+ * heapInit().
+ *
+ * \return none
+ */
+static void eventsInit(void)
+{
+  const char *path = getenv("MALLOC_EVENTS");
+  if (path == NULL || *path == '\0')
+  {
+    return;
+  }
+  eventsFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (eventsFd < 0)
+  {
+    return;
+  }
+  statsWrite(eventsFd, EVENTS_MAGIC, EVENTS_MAGIC_SIZE);
+  eventsOn = true;
+
+  /* A second clock record comes with every flush */
+  eventsFlush();
+}
+
+/* Writes out what the rings still hold when the process exits */
+static void eventsAtExit(void)
+{
+  if (eventsOn)
+  {
+    eventsFlush();
+  }
+}
+
+/*
+ * \brief growheap
+ *
+ * Given a requested size of memory, use sbrk() to dynamically
+ * increase the data segment of the calling process.  The heap grows by
+ * at least the arena's current chunk size, which doubles on every grow
+ * up to MAX_GROW, and the new space ends up in the arena's top _block.
+ * When the break has not moved since the last grow the top simply gets
+ * longer, over its old fencepost; otherwise the old top is put on the
+ * free lists and a new top _block is started.  Fresh pages read zero,
+ * which the top's clean mark keeps track of for calloc().
+ *
+ * \param a arena to grow
+ * \param size payload size in bytes the top must be able to hold
+ *
+ * \return returns the top _block or NULL if failed
+ */
+static struct _block *growHeap(struct _arena *a, size_t size)
+{
+  size_t length = (size + sizeof(struct _block) + FENCE_SIZE + pageSize - 1) &
+                  ~(pageSize - 1);
+  if (length < a->growSize)
+  {
+    length = a->growSize;
+  }
+
+  /* Grow the arena's own huge page range in whole huge pages */
+  char *brk = NULL;
+  char *prev = (char *)-1;
+  size_t pad = 0;
+  if (hugePages && hugeReserve(a))
+  {
+    size_t hugeLength = (length + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    brk = a->hugeBrk;
+    pad = (ALIGNMENT - sizeof(struct _block) - (uintptr_t)brk) &
+          (ALIGNMENT - 1);
+    prev = hugeSbrk(a, (intptr_t)(pad + hugeLength));
+    if (prev != (char *)-1)
+    {
+      length = hugeLength;
+    }
+  }
+
+  /* Request more space from OS; the break is shared by every arena */
+  if (prev == (char *)-1)
+  {
+    pthread_mutex_lock(&sbrkLock);
+    brk = sbrk(0);
+    pad = (ALIGNMENT - sizeof(struct _block) - (uintptr_t)brk) &
+          (ALIGNMENT - 1);
+    prev = sbrk(pad + length);
+    pthread_mutex_unlock(&sbrkLock);
+  }
+
+  /* OS allocation failed */
+  if (prev == (char *)-1)
+  {
+    return NULL;
+  }
+
+  assert(prev == brk);
+  struct _block *curr = (struct _block *)(prev + pad);
+
+  a->num_grows++;
+  EVENT(EVENT_GROW, 0, curr, length, 0, (int)(a - arenas));
+  a->heap_size = a->heap_size + length;
+  if (a->heap_size > a->max_heap)
+  {
+    a->max_heap = a->heap_size;
+  }
+  if (a->growSize < MAX_GROW)
+  {
+    a->growSize = a->growSize * 2;
+  }
+
+  /* Nobody else moved the break, so the top just gets longer */
+  if (a->top && (char *)BLOCK_NEXT(a->top) + FENCE_SIZE == (char *)curr)
+  {
+    /* The old footer and fencepost end up inside the clean part */
+    BLOCK_FOOTER(a->top) = 0;
+    BLOCK_NEXT(a->top)->head = 0;
+    SET_SIZE(a->top, BLOCK_SIZE(a->top) + length);
+    BLOCK_NEXT(a->top)->head = (a->top->head & ~(SIZE_MASK | 7)) |
+                               BLOCK_PREV_FREE;
+    BLOCK_FOOTER(a->top) = BLOCK_SIZE(a->top);
+    return a->top;
+  }
+
+  /* Retire the old top to the free lists */
+  if (a->top)
+  {
+    insertFree(a, a->top);
+    a->num_blocks++;
+  }
+
+  /* The new top takes everything but the fencepost */
+  size_t arena = (size_t)(a - arenas) << ARENA_SHIFT;
+  curr->head = arena | (length - sizeof(struct _block) - FENCE_SIZE);
+  BLOCK_NEXT(curr)->head = arena;
+  markFree(curr);
+  a->top = curr;
+
+  /* Someone else may have left data below the break on the first page */
+  a->topClean = (char *)(((uintptr_t)BLOCK_DATA(curr) + pageSize - 1) &
+                         ~(pageSize - 1));
+  return curr;
+}
+
+/*
+ * \brief splitBlock
+ *
+ * Gives the tail of _block b back to the free lists when what is left
+ * over after size bytes is big enough to be a _block of its own.
+ *
+ * \param a arena that owns b
+ * \param b _block being handed out, not on any free list
+ * \param size payload size b must keep
+ *
+ * \return none
+ */
+static void splitBlock(struct _arena *a, struct _block *b, size_t size)
+{
+  struct _block *temp = carveBlock(b, size);
+  if (temp)
+  {
+    insertFree(a, temp);
+    if (a->find == nextFit)
+    {
+      a->bins[sizeToBin(BLOCK_SIZE(temp))] = temp;
+    }
+    a->num_blocks++;
+    a->num_splits++;
+    EVENT(EVENT_SPLIT, 0, b, BLOCK_SIZE(b), BLOCK_SIZE(temp),
+          (int)(a - arenas));
+  }
+}
+
+/*
+ * \brief topAlloc
+ *
+ * Cuts size bytes off the front of the arena's top _block, growing the
+ * heap first if the top is missing or too small.  Whatever is left over
+ * stays behind as the new top.
+ *
+ * \param a arena to allocate from
+ * \param size aligned payload size in bytes
+ * \param dirty if not NULL, set to how many leading bytes may be non-zero
+ *
+ * \return the _block or NULL if the heap could not grow
+ */
+static struct _block *topAlloc(struct _arena *a, size_t size, size_t *dirty)
+{
+  if ((a->top == NULL || BLOCK_SIZE(a->top) < size) && !growHeap(a, size))
+  {
+    return NULL;
+  }
+  struct _block *b = a->top;
+  char *data = (char *)BLOCK_DATA(b);
+  if (dirty)
+  {
+    *dirty = a->topClean > data ? (size_t)(a->topClean - data) : 0;
+  }
+  a->top = carveBlock(b, size);
+  if (a->top == NULL)
+  {
+    BLOCK_FOOTER(b) = 0;
+  }
+  else if (a->topClean < (char *)BLOCK_DATA(a->top))
+  {
+    a->topClean = (char *)BLOCK_DATA(a->top);
+  }
+  markUsed(b);
+  return b;
+}
+
+/*
+ * \brief releaseSpan
+ *
+ * Lets the kernel drop the whole pages inside free _block b.  The header,
+ * the free and tree links in front of them and the footer behind them
+ * are left untouched, and the pages read back as zero if the _block is
+ * handed out again.  The partial pages at either end are cleared too,
+ * so that b as a whole is known to be zero past its links.
+ *
+ * \param a arena that owns b
+ * \param b free _block
+ *
+ * \return bytes released
+ */
+static size_t releaseSpan(struct _arena *a, struct _block *b)
+{
+  uintptr_t links = (uintptr_t)TREE_LINKS(b) + sizeof(struct _treeLinks);
+  uintptr_t start = (links + pageSize - 1) & ~(pageSize - 1);
+  uintptr_t footer = (uintptr_t)BLOCK_END(b) - sizeof(size_t);
+  uintptr_t end = footer & ~(pageSize - 1);
+  if (IS_ZEROED(b) || end <= start ||
+      madvise((void *)start, end - start, MADV_DONTNEED))
+  {
+    return 0;
+  }
+  memset((void *)links, 0, start - links);
+  memset((void *)end, 0, footer - end);
+  if (b == a->top)
+  {
+    if (a->topClean > (char *)links)
+    {
+      a->topClean = (char *)links;
+    }
+  }
+  else
+  {
+    b->head |= BLOCK_ZEROED;
+  }
+  a->num_trims++;
+  return end - start;
+}
+
+/*
+ * \brief trimTop
+ *
+ * Gives the end of the arena's top _block back to the kernel, keeping at
+ * least pad bytes of it.  Only a top that ends at the program break, or
+ * at the break of the arena's huge page range, can shrink it; any other
+ * top just has its pages released.
+ *
+ * \param a locked arena
+ * \param pad bytes of top to keep
+ *
+ * \return bytes released
+ */
+static size_t trimTop(struct _arena *a, size_t pad)
+{
+  struct _block *top = a->top;
+  if (top == NULL)
+  {
+    return 0;
+  }
+  if (pad < MIN_PAYLOAD)
+  {
+    pad = MIN_PAYLOAD;
+  }
+  if (BLOCK_SIZE(top) < pad + pageSize)
+  {
+    return 0;
+  }
+  size_t length = (BLOCK_SIZE(top) - pad) & ~(pageSize - 1);
+
+  pthread_mutex_lock(&sbrkLock);
+  char *brk = (char *)BLOCK_NEXT(top) + FENCE_SIZE;
+  bool atBreak;
+  if (a->hugeBase && (size_t)(brk - a->hugeBase) <= HUGE_REGION)
+  {
+    atBreak = brk == a->hugeBrk &&
+              hugeSbrk(a, -(intptr_t)length) != (char *)-1;
+  }
+  else
+  {
+    atBreak = brk == (char *)sbrk(0) &&
+              sbrk(-(intptr_t)length) != (void *)-1;
+  }
+
+  /* The page under the new break stays mapped, and must read zero again
+   * when the heap grows back over it */
+  if (atBreak)
+  {
+    brk = brk - length;
+    memset(brk, 0, (((uintptr_t)brk + pageSize - 1) & ~(pageSize - 1)) -
+                   (uintptr_t)brk);
+  }
+  pthread_mutex_unlock(&sbrkLock);
+
+  if (!atBreak)
+  {
+    return releaseSpan(a, top);
+  }
+  SET_SIZE(top, BLOCK_SIZE(top) - length);
+  BLOCK_NEXT(top)->head = (top->head & ~(SIZE_MASK | 7)) | BLOCK_PREV_FREE;
+  BLOCK_FOOTER(top) = BLOCK_SIZE(top);
+  a->heap_size = a->heap_size - length;
+  a->num_trims++;
+  return length;
+}
+
+/*
+ * \brief heapTrim
+ *
+ * Releases the pages of every free _block in the arena and shrinks its
+ * top down to pad bytes.
+ *
+ * \param a locked arena
+ * \param pad bytes of top to keep
+ *
+ * \return bytes released
+ */
+static size_t heapTrim(struct _arena *a, size_t pad)
+{
+  size_t released = 0;
+  for (int bin = nextNonEmptyBin(a, 0); bin >= 0;
+       bin = nextNonEmptyBin(a, bin + 1))
+  {
+    struct _block *b = a->bins[bin];
+    do
+    {
+      released += releaseSpan(a, b);
+      b = FREE_LINKS(b)->nextFree;
+    } while (b != a->bins[bin]);
+  }
+  return released + trimTop(a, pad);
+}
+
+/*
+ * \brief absorbNext
+ *
+ * Merges b with the _block that follows it.  Caller has checked that the
+ * next _block is free and unlinked it from its free list, and fixes up
+ * the flags and footer once b is final.
+ *
+ * \param a arena that owns b
+ * \param b the _block that grows
+ *
+ * \return none
+ */
+static void absorbNext(struct _arena *a, struct _block *b)
+{
+  SET_SIZE(b, BLOCK_SIZE(b) + sizeof(struct _block) +
+              BLOCK_SIZE(BLOCK_NEXT(b)));
+  a->num_blocks--;
+  a->num_coalesces++;
+  EVENT(EVENT_COALESCE, 0, b, BLOCK_SIZE(b), 0, (int)(a - arenas));
+}
+
+/*
+ * Everything above works on one arena and must be called with its lock
+ * held.  Small _blocks are also cached per thread: a freed small _block
+ * is pushed onto the calling thread's cache without taking any lock,
+ * still marked in use, and handed straight back by the next malloc of the
+ * same size class on that thread.  An arena is only touched when a cache
+ * bin is empty (miss) or full (overflow).  Slab slots are cached the
+ * same way, whichever arena they belong to.
+ */
+#define TCACHE_BINS       NUM_SMALL_BINS
+#define TCACHE_COUNT      16     /* Most _blocks cached per size class */
+
+struct _counts
+{
+   uint64_t mallocs;
+   uint64_t frees;
+   uint64_t hits;
+   uint64_t requested;
+   uint64_t sizes[STAT_SIZES];  /* Requests of 2^i to 2^(i+1)-1 bytes */
+};
+
+struct _tcache
+{
+   struct _block *entries[TCACHE_BINS]; /* Stacks linked through nextFree */
+   unsigned char counts[TCACHE_BINS];
+   void  *slots[SLAB_CLASSES];          /* Slab slots linked through word 0 */
+   unsigned char slotCounts[SLAB_CLASSES];
+   bool   registered;    /* Exit destructor installed for this thread  */
+   bool   disabled;      /* Thread is exiting, bypass the cache        */
+   bool   linked;        /* On the threadCaches list                   */
+   struct _counts stats; /* This thread's lock-free counts             */
+   struct _tcache *prevCache;           /* Neighbours on threadCaches  */
+   struct _tcache *nextCache;
+   int64_t  sampleLeft;  /* Bytes to allocate before the next sample   */
+   uint64_t sampleSeed;  /* Sampling interval generator, 0 until seeded */
+   bool   inProfile;     /* Inside the profiler, sample nothing        */
+};
+
+static __thread struct _tcache tcache __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcacheKey;
+
+/*
+ * \brief eventRecord
+ *
+ * Appends an event to the calling thread's ring.  Defined after tcache,
+ * which tells it whether the thread is exiting.  start is when the call
+ * being traced began, or 0 for an instant inside it; only calls start
+ * the flush thread, since instants are recorded under arena locks.
+ *
+ * \return none
+ */
+static __attribute__((noinline)) void eventRecord(int type, uint64_t start,
+                                                   uint64_t a, uint64_t b,
+                                                   uint64_t c, int arena)
+{
+  struct _eventRing *r = eventRing;
+  if (r == NULL)
+  {
+    /* An exiting thread has handed its ring back, so it does not take
+       another for what its last frees record */
+    if (tcache.disabled)
+    {
+      return;
+    }
+    r = eventRingClaim();
+  }
+  if (r == NULL)
+  {
+    return;
+  }
+  uint64_t now = eventClock();
+  uint64_t head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == EVENT_RING)
+  {
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    struct _event *e = &r->events[head & (EVENT_RING - 1)];
+    uint64_t ticks = start ? now - start : 0;
+    e->tsc = start ? start : now;
+    e->duration = ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks;
+    e->tid = r->tid;
+    e->type = (uint8_t)type;
+    e->arena = (uint8_t)arena;
+    e->a = a;
+    e->b = b;
+    e->c = c;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  }
+
+  if (start && !__atomic_load_n(&eventsWorkerUp, __ATOMIC_RELAXED) &&
+      !__atomic_exchange_n(&eventsWorkerUp, true, __ATOMIC_ACQ_REL))
+  {
+    pthread_t worker;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&worker, &attr, eventsWorker, NULL);
+    pthread_attr_destroy(&attr);
+  }
+}
+
+/*
+ * Every registered thread's cache is on threadCaches so that statistics
+ * can add up its counts on demand.  A thread's counts move to
+ * sharedStats when it exits, and counts made by a thread that is not on
+ * the list go there directly.
+ */
+static struct _tcache *threadCaches = NULL;
+static struct _counts sharedStats;
+static pthread_mutex_t threadCachesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Adds n to one of the calling thread's counters.  Only the owner ever
+ * writes its counters, so a plain add published with a relaxed store is
+ * enough for other threads to read them without a lock.
+ */
+#define THREAD_COUNT(field, n)                                           \
+  do                                                                     \
+  {                                                                      \
+    if (tcache.linked)                                                   \
+    {                                                                    \
+      __atomic_store_n(&tcache.stats.field, tcache.stats.field + (n),    \
+                       __ATOMIC_RELAXED);                                \
+    }                                                                    \
+    else                                                                 \
+    {                                                                    \
+      __atomic_add_fetch(&sharedStats.field, (n), __ATOMIC_RELAXED);     \
+    }                                                                    \
+  } while (0)
+
+/*
+ * \brief lockArena
+ *
+ * Takes an arena's lock.
+ *
+ * \return a
+ */
+static inline struct _arena *lockArena(struct _arena *a)
+{
+  pthread_mutex_lock(&a->lock);
+  return a;
+}
+
+/*
+ * \brief tcacheUsable
+ *
+ * \return true if the calling thread may use its cache
+ */
+static inline bool tcacheUsable( void )
+{
+  return __atomic_load_n(&heapState, __ATOMIC_ACQUIRE) == 2 &&
+         !tcache.disabled;
+}
+
+/*
+ * \brief tcacheRegister
+ *
+ * Installs the calling thread's exit destructor and puts its cache on
+ * threadCaches.  Does nothing once done, or while the cache is unusable.
+ *
+ * \return none
+ */
+static void tcacheRegister( void )
+{
+  if (tcache.registered || !tcacheUsable())
+  {
+    return;
+  }
+  tcache.registered = true;
+  /* Any non-NULL value makes the destructor run at thread exit */
+  pthread_setspecific(tcacheKey, &tcache);
+  pthread_mutex_lock(&threadCachesLock);
+  tcache.prevCache = NULL;
+  tcache.nextCache = threadCaches;
+  if (threadCaches)
+  {
+    threadCaches->prevCache = &tcache;
+  }
+  threadCaches = &tcache;
+  tcache.linked = true;
+  pthread_mutex_unlock(&threadCachesLock);
+}
+
+static void heapFree(struct _arena *a, struct _block *curr);
+static void quickFree(struct _arena *a, struct _block *b);
+static void slabFree(struct _arena *a, struct _slab *s, void *ptr);
+
+/*
+ * \brief tcacheFlush
+ *
+ * Returns cached _blocks of one size class to their arenas until only
+ * keep are left, holding each arena's lock across a run of its _blocks.
+ *
+ * \param bin size class to flush
+ * \param keep number of _blocks to leave in the cache
+ *
+ * \return none
+ */
+static void tcacheFlush(int bin, int keep)
+{
+  struct _arena *locked = NULL;
+  while (tcache.counts[bin] > keep)
+  {
+    struct _block *b = tcache.entries[bin];
+    struct _arena *a = &arenas[BLOCK_ARENA(b)];
+    tcache.entries[bin] = FREE_LINKS(b)->nextFree;
+    tcache.counts[bin]--;
+    if (a != locked)
+    {
+      if (locked)
+      {
+        pthread_mutex_unlock(&locked->lock);
+      }
+      locked = lockArena(a);
+    }
+    quickFree(a, b);
+  }
+  if (locked)
+  {
+    pthread_mutex_unlock(&locked->lock);
+  }
+}
+
+/*
+ * \brief slotFlush
+ *
+ * Returns cached slots of one slab class to their slabs until only keep
+ * are left, holding each arena's lock across a run of its slots.
+ *
+ * \param cls slab class to flush
+ * \param keep number of slots to leave in the cache
+ *
+ * \return none
+ */
+static void slotFlush(int cls, int keep)
+{
+  struct _arena *locked = NULL;
+  while (tcache.slotCounts[cls] > keep)
+  {
+    void *ptr = tcache.slots[cls];
+    struct _slab *s = SLAB_OF(ptr);
+    struct _arena *a = &arenas[s->arena];
+    tcache.slots[cls] = *(void **)ptr;
+    tcache.slotCounts[cls]--;
+    if (a != locked)
+    {
+      if (locked)
+      {
+        pthread_mutex_unlock(&locked->lock);
+      }
+      locked = lockArena(a);
+    }
+    slabFree(a, s, ptr);
+  }
+  if (locked)
+  {
+    pthread_mutex_unlock(&locked->lock);
+  }
+}
+
+/*
+ * \brief tcacheDestroy
+ *
+ * Thread exit destructor: hands every cached _block and slot back to its
+ * arena and makes any later free() on this thread bypass the cache.
+ *
+ * \return none
+ */
+static void tcacheDestroy(void *arg)
+{
+  (void)arg;
+  tcache.disabled = true;
+  for (int bin = 0; bin < TCACHE_BINS; bin++)
+  {
+    tcacheFlush(bin, 0);
+  }
+  for (int cls = 0; cls < SLAB_CLASSES; cls++)
+  {
+    slotFlush(cls, 0);
+  }
+  /* Only now, as the flushes above record splits and coalesces */
+  if (eventRing)
+  {
+    __atomic_store_n(&eventRing->dead, 1, __ATOMIC_RELEASE);
+    eventRing = NULL;
+  }
+
+  /* The thread's memory goes away, so its counts move to sharedStats */
+  if (!tcache.linked)
+  {
+    return;
+  }
+  pthread_mutex_lock(&threadCachesLock);
+  if (tcache.prevCache)
+  {
+    tcache.prevCache->nextCache = tcache.nextCache;
+  }
+  else
+  {
+    threadCaches = tcache.nextCache;
+  }
+  if (tcache.nextCache)
+  {
+    tcache.nextCache->prevCache = tcache.prevCache;
+  }
+  tcache.linked = false;
+  uint64_t *from = (uint64_t *)&tcache.stats;
+  uint64_t *to = (uint64_t *)&sharedStats;
+  for (size_t i = 0; i < sizeof(struct _counts) / sizeof(uint64_t); i++)
+  {
+    __atomic_add_fetch(&to[i], from[i], __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&threadCachesLock);
+}
+
+/*
+ * \brief tcacheRefill
+ *
+ * After a miss, moves free _blocks of exactly the missed size class from
+ * the arena's quick list and bins into the cache so the next few mallocs
+ * stay lock-free.  Never grows the heap.  Called with the arena's lock
+ * held.
+ *
+ * \param a locked arena
+ * \param bin small size class that missed
+ *
+ * \return none
+ */
+static void tcacheRefill(struct _arena *a, int bin)
+{
+  while (bin < NUM_QUICK && tcache.counts[bin] < TCACHE_COUNT / 2 &&
+         a->quick[bin] && tcache.registered)
+  {
+    struct _block *b = a->quick[bin];
+    a->quick[bin] = FREE_LINKS(b)->nextFree;
+    a->quickCount--;
+    a->num_quick_hits++;
+    FREE_LINKS(b)->nextFree = tcache.entries[bin];
+    tcache.entries[bin] = b;
+    tcache.counts[bin]++;
+  }
+  while (tcache.counts[bin] < TCACHE_COUNT / 2 && a->bins[bin] &&
+         tcache.registered)
+  {
+    struct _block *b = a->bins[bin];
+    removeFree(a, b);
+    markUsed(b);
+    a->num_blocks--;
+    FREE_LINKS(b)->nextFree = tcache.entries[bin];
+    tcache.entries[bin] = b;
+    tcache.counts[bin]++;
+  }
+}
+
+/*
+ * \brief threadArenaBind
+ *
+ * \return the calling thread's arena, choosing one on first use
+ */
+static struct _arena *threadArenaBind(void)
+{
+  if (threadArena)
+  {
+    return threadArena;
+  }
+  if (__atomic_load_n(&heapState, __ATOMIC_ACQUIRE) != 2)
+  {
+    /* Still initializing: use the main arena without binding */
+    return &arenas[0];
+  }
+  int index;
+  if (arenaPolicy == ARENA_CPU)
+  {
+    int cpu = sched_getcpu();
+    index = cpu < 0 ? 0 : cpu % numArenas;
+  }
+  else
+  {
+    index = __atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % numArenas;
+  }
+  threadArena = &arenas[index];
+  tcacheRegister();
+  return threadArena;
+}
+
+/*
+ * Sampling heap profiler, turned on with MALLOC_PROFILE=1.  Each thread
+ * counts down an exponentially distributed number of allocated bytes,
+ * MALLOC_PROFILE_RATE (512 KB) on average, and records the backtrace of
+ * the allocation that takes it past zero.  Sampling is then a Poisson
+ * process over the bytes allocated, so a sample stands for an estimable
+ * number of objects of its size however large or small they are.
+ * Sampled objects stay in the profile until they are freed.
+ *
+ * The live profile is written out at exit, when MALLOC_PROFILE_SIGNAL is
+ * delivered, or by malloc_profile_dump(), to MALLOC_PROFILE_FILE or
+ * malloc.<pid>.heap: in the legacy heap format pprof reads, or as folded
+ * stacks for flame graphs if the name ends in ".folded".
+ *
+ * Calls that are not sampled pay one thread-local subtraction, and while
+ * profiling each free() one lookup in profileFilter, a counting filter of
+ * the sampled addresses.  The tables have their own mappings and are
+ * only touched, under profileLock, for sampled objects.
+ */
+#define PROFILE_RATE      (512 * 1024)
+#define PROFILE_DEPTH     32     /* Frames kept per backtrace */
+#define PROFILE_SKIP      2      /* profileSample() and the entry point */
+#define PROFILE_STACKS    (1 << 14)
+#define PROFILE_OBJECTS   (1 << 12)   /* Initial live table size */
+#define PROFILE_FILTER    (1 << 16)
+#define PROFILE_LINE      4096   /* Room left in the dump buffer per line */
+
+struct _profileStack
+{
+   uint64_t hash;                      /* 0 marks an empty slot */
+   int      depth;
+   void    *pcs[PROFILE_DEPTH];
+   double   liveCount;                 /* Estimated objects and bytes */
+   double   liveBytes;
+   uint64_t liveSamples;               /* The samples themselves, which */
+   uint64_t liveSampledBytes;          /* pprof scales up on its own    */
+   uint64_t allocSamples;              /* Everything ever sampled here  */
+   uint64_t allocSampledBytes;
+};
+
+struct _profileObject
+{
+   uintptr_t ptr;                      /* 0 marks an empty slot */
+   uint32_t  stack;
+   size_t    size;
+   double    count;
+   double    bytes;
+};
+
+static size_t profileRate   = 0;       /* 0 when not profiling */
+static const char *profileFile = NULL;
+static int profileSignal    = 0;
+static bool profileWorkerUp = false;
+static sem_t profileSem;
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+static struct _profileStack *profileStacks = NULL;
+static struct _profileObject *profileObjects = NULL;
+static size_t profileObjectsSize  = 0;
+static size_t profileObjectsCount = 0;
+static uint16_t profileFilter[PROFILE_FILTER];
+
+/*
+ * \brief profileLog
+ *
+ * Natural logarithm, good to about six digits, so that the library needs
+ * nothing from libm.
+ *
+ * \return ln(x) for x > 0
+ */
+static double profileLog(double x)
+{
+  union { double d; uint64_t u; } v = { x };
+  int exponent = (int)((v.u >> 52) & 0x7ff) - 1023;
+  v.u = (v.u & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+  double t = (v.d - 1) / (v.d + 1);
+  double t2 = t * t;
+  return exponent * 0.6931471805599453 +
+         2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+}
+
+/*
+ * \brief profileExp
+ *
+ * \return e^-x for 0 <= x <= 64, to about four digits
+ */
+static double profileExp(double x)
+{
+  double y = x / 1024;
+  double result = 1 - y * (1 - y * (0.5 - y / 6));
+  for (int i = 0; i < 10; i++)
+  {
+    result = result * result;
+  }
+  return result;
+}
+
+/*
+ * \brief profileInterval
+ *
+ * \return bytes until the calling thread's next sample
+ */
+static int64_t profileInterval(void)
+{
+  uint64_t x = tcache.sampleSeed;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  tcache.sampleSeed = x;
+  double uniform = ((x >> 11) + 1) * 0x1p-53;
+  return (int64_t)(-profileLog(uniform) * profileRate) + 1;
+}
+
+static inline uint64_t profileHash(const void *ptr)
+{
+  return ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull;
+}
+
+static inline uint16_t *profileFilterOf(const void *ptr)
+{
+  return &profileFilter[profileHash(ptr) >> 48];
+}
+
+/*
+ * \brief profileSlot
+ *
+ * \return the live table slot that holds ptr, or the empty one it would
+ * go in
+ */
+static size_t profileSlot(uintptr_t ptr)
+{
+  size_t mask = profileObjectsSize - 1;
+  size_t i = (size_t)(profileHash((void *)ptr) >> 20) & mask;
+  while (profileObjects[i].ptr && profileObjects[i].ptr != ptr)
+  {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/*
+ * \brief profileReserve
+ *
+ * Maps the stack table on first use and doubles the live table when it
+ * is half full.  Called with profileLock held.
+ *
+ * \return false if there was no memory for either
+ */
+static bool profileReserve(void)
+{
+  if (profileStacks == NULL)
+  {
+    void *stacks = mmap(NULL, PROFILE_STACKS * sizeof(struct _profileStack),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stacks == MAP_FAILED)
+    {
+      return false;
+    }
+    profileStacks = stacks;
+  }
+  if ((profileObjectsCount + 1) * 2 <= profileObjectsSize)
+  {
+    return true;
+  }
+
+  size_t size = profileObjectsSize ? profileObjectsSize * 2 : PROFILE_OBJECTS;
+  struct _profileObject *fresh = mmap(NULL,
+                                      size * sizeof(struct _profileObject),
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (fresh == MAP_FAILED)
+  {
+    return false;
+  }
+  struct _profileObject *old = profileObjects;
+  size_t oldSize = profileObjectsSize;
+  profileObjects = fresh;
+  profileObjectsSize = size;
+  for (size_t i = 0; i < oldSize; i++)
+  {
+    if (old[i].ptr)
+    {
+      profileObjects[profileSlot(old[i].ptr)] = old[i];
+    }
+  }
+  if (old)
+  {
+    munmap(old, oldSize * sizeof(struct _profileObject));
+  }
+  return true;
+}
+
+/*
+ * \brief profileStackOf
+ *
+ * Finds or adds the entry for a backtrace.  Called with profileLock held.
+ *
+ * \return the entry's index, or -1 if the table is full
+ */
+static int profileStackOf(void **pcs, int depth)
+{
+  uint64_t hash = 1469598103934665603ull;
+  for (int i = 0; i < depth; i++)
+  {
+    hash = (hash ^ (uintptr_t)pcs[i]) * 1099511628211ull;
+  }
+  hash = hash | 1;
+
+  size_t mask = PROFILE_STACKS - 1;
+  for (size_t n = 0, i = hash & mask; n < PROFILE_STACKS;
+       n++, i = (i + 1) & mask)
+  {
+    struct _profileStack *s = &profileStacks[i];
+    if (s->hash == 0)
+    {
+      s->hash = hash;
+      s->depth = depth;
+      memcpy(s->pcs, pcs, depth * sizeof(void *));
+      return (int)i;
+    }
+    if (s->hash == hash && s->depth == depth &&
+        memcmp(s->pcs, pcs, depth * sizeof(void *)) == 0)
+    {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+static void *profileWorker(void *arg);
+
+/*
+ * \brief profileSample
+ *
+ * Slow path of PROFILE_ALLOC, taken once the calling thread's countdown
+ * runs out.  Draws the next interval and records ptr.  A sample of size
+ * bytes stands for 1 / (1 - e^(-size/rate)) objects, the expected number
+ * allocated per sample taken.
+ *
+ * \param ptr the memory just allocated, or NULL if that failed
+ * \param size the size it was requested with
+ *
+ * \return none
+ */
+static __attribute__((noinline)) void profileSample(void *ptr, size_t size)
+{
+  if (profileRate == 0)
+  {
+    /* Check again once setup has read MALLOC_PROFILE */
+    tcache.sampleLeft = heapState == 2 ? INT64_MAX : 0;
+    return;
+  }
+  if (tcache.sampleSeed == 0)
+  {
+    /* A thread starts part way into an interval, not on a sample */
+    tcache.sampleSeed = ((uintptr_t)&tcache * 0x9E3779B97F4A7C15ull) | 1;
+    tcache.sampleLeft = profileInterval();
+    return;
+  }
+  tcache.sampleLeft = profileInterval();
+  if (ptr == NULL || tcache.inProfile)
+  {
+    return;
+  }
+
+  /* Whatever backtrace() and pthread_create() allocate is not sampled */
+  tcache.inProfile = true;
+  if (profileSignal &&
+      !__atomic_exchange_n(&profileWorkerUp, true, __ATOMIC_ACQ_REL))
+  {
+    pthread_t worker;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&worker, &attr, profileWorker, NULL);
+    pthread_attr_destroy(&attr);
+  }
+  void *pcs[PROFILE_DEPTH + PROFILE_SKIP];
+  int depth = backtrace(pcs, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+  if (depth < 0)
+  {
+    depth = 0;
+  }
+
+  double ratio = (double)size / profileRate;
+  double count = ratio > 64 ? 1 : 1 / (1 - profileExp(ratio));
+  pthread_mutex_lock(&profileLock);
+  int stack = profileReserve() ? profileStackOf(pcs + PROFILE_SKIP, depth)
+                               : -1;
+  if (stack >= 0)
+  {
+    struct _profileStack *s = &profileStacks[stack];
+    s->liveCount += count;
+    s->liveBytes += count * size;
+    s->liveSamples++;
+    s->liveSampledBytes += size;
+    s->allocSamples++;
+    s->allocSampledBytes += size;
+
+    struct _profileObject *o = &profileObjects[profileSlot((uintptr_t)ptr)];
+    if (o->ptr)
+    {
+      /* Left behind by a free() the profiler could not see */
+      profileStacks[o->stack].liveCount -= o->count;
+      profileStacks[o->stack].liveBytes -= o->bytes;
+      profileStacks[o->stack].liveSamples--;
+      profileStacks[o->stack].liveSampledBytes -= o->size;
+    }
+    else
+    {
+      profileObjectsCount++;
+      __atomic_add_fetch(profileFilterOf(ptr), 1, __ATOMIC_RELAXED);
+    }
+    *o = (struct _profileObject){ (uintptr_t)ptr, (uint32_t)stack, size,
+                                  count, count * size };
+  }
+  pthread_mutex_unlock(&profileLock);
+  tcache.inProfile = false;
+}
+
+/*
+ * Counts size bytes against the calling thread's sampling interval and
+ * samples ptr when it runs out.  A macro so that the backtrace always
+ * starts at the entry point the application called.
+ */
+#define PROFILE_ALLOC(ptr, size)                                         \
+  do                                                                     \
+  {                                                                      \
+    tcache.sampleLeft = tcache.sampleLeft - (int64_t)(size);             \
+    if (__builtin_expect(tcache.sampleLeft < 0, 0))                      \
+    {                                                                    \
+      profileSample((ptr), (size));                                      \
+    }                                                                    \
+  } while (0)
+
+/*
+ * \brief profileForget
+ *
+ * Takes ptr out of the profile if it was sampled.
+ *
+ * \return none
+ */
+static __attribute__((noinline)) void profileForget(void *ptr)
+{
+  if (tcache.inProfile)
+  {
+    return;
+  }
+  pthread_mutex_lock(&profileLock);
+  size_t i = profileObjectsSize ? profileSlot((uintptr_t)ptr) : 0;
+  if (profileObjectsSize && profileObjects[i].ptr)
+  {
+    struct _profileObject *o = &profileObjects[i];
+    profileStacks[o->stack].liveCount -= o->count;
+    profileStacks[o->stack].liveBytes -= o->bytes;
+    profileStacks[o->stack].liveSamples--;
+    profileStacks[o->stack].liveSampledBytes -= o->size;
+    o->ptr = 0;
+    profileObjectsCount--;
+    __atomic_sub_fetch(profileFilterOf(ptr), 1, __ATOMIC_RELAXED);
+
+    /* Move back any entry that could no longer be found past the hole */
+    size_t mask = profileObjectsSize - 1;
+    for (size_t j = (i + 1) & mask; profileObjects[j].ptr; j = (j + 1) & mask)
+    {
+      struct _profileObject moved = profileObjects[j];
+      profileObjects[j].ptr = 0;
+      profileObjects[profileSlot(moved.ptr)] = moved;
+    }
+  }
+  pthread_mutex_unlock(&profileLock);
+}
+
+#define PROFILE_FREE(ptr)                                                \
+  do                                                                     \
+  {                                                                      \
+    if (__builtin_expect(profileRate != 0, 0) &&                         \
+        __atomic_load_n(profileFilterOf(ptr), __ATOMIC_RELAXED))         \
+    {                                                                    \
+      profileForget(ptr);                                                \
+    }                                                                    \
+  } while (0)
+
+/*
+ * For a realloc() that moved an object itself rather than through
+ * allocate() and free(): the old address leaves the profile and the new
+ * one counts as an allocation of the new size.
+ */
+#define PROFILE_MOVE(old, ptr, size)                                     \
+  do                                                                     \
+  {                                                                      \
+    if ((ptr) != (old))                                                  \
+    {                                                                    \
+      PROFILE_FREE(old);                                                 \
+      PROFILE_ALLOC((ptr), (size));                                      \
+    }                                                                    \
+  } while (0)
+
+/*
+ * \brief profileFrame
+ *
+ * Appends a frame's function name, or library and offset if it has no
+ * exported name.  pc is a return address, so the call itself is the
+ * byte before it.
+ *
+ * \return none
+ */
+static void profileFrame(char *buf, size_t size, size_t *len, void *pc)
+{
+  Dl_info info;
+  if (dladdr((char *)pc - 1, &info) == 0 || info.dli_fname == NULL)
+  {
+    statsPrintf(buf, size, len, "%p", pc);
+  }
+  else if (info.dli_sname)
+  {
+    statsPrintf(buf, size, len, "%s", info.dli_sname);
+  }
+  else
+  {
+    const char *name = strrchr(info.dli_fname, '/');
+    statsPrintf(buf, size, len, "%s+%#lx", name ? name + 1 : info.dli_fname,
+                (unsigned long)((char *)pc - (char *)info.dli_fbase));
+  }
+}
+
+/*
+ * \brief malloc_profile_dump
+ *
+ * Writes the live heap profile.  In the pprof format each line gives the
+ * estimated live objects and bytes, then everything allocated, for one
+ * backtrace, followed by the process's mappings so that pprof can
+ * symbolize it.  In the folded format each line is a backtrace, outermost
+ * frame first, and its live bytes.
+ *
+ * \param path file to create or overwrite, NULL for the default
+ *
+ * \return 0, or -1 with errno set if profiling is off or the file could
+ * not be opened
+ */
+int malloc_profile_dump(const char *path)
+{
+  if (profileRate == 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  char name[64];
+  if (path == NULL)
+  {
+    path = profileFile;
+  }
+  if (path == NULL)
+  {
+    snprintf(name, sizeof(name), "malloc.%d.heap", (int)getpid());
+    path = name;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  size_t pathLen = strlen(path);
+  bool folded = pathLen >= 7 && strcmp(path + pathLen - 7, ".folded") == 0;
+
+  bool nested = tcache.inProfile;
+  tcache.inProfile = true;
+  pthread_mutex_lock(&profileLock);
+  char buf[32768];
+  size_t len = 0;
+  if (!folded)
+  {
+    /* heap_v2 carries the raw samples; pprof unsamples them by the rate */
+    uint64_t totals[4] = { 0, 0, 0, 0 };
+    for (size_t i = 0; profileStacks && i < PROFILE_STACKS; i++)
+    {
+      totals[0] += profileStacks[i].liveSamples;
+      totals[1] += profileStacks[i].liveSampledBytes;
+      totals[2] += profileStacks[i].allocSamples;
+      totals[3] += profileStacks[i].allocSampledBytes;
+    }
+    statsPrintf(buf, sizeof(buf), &len,
+                "heap profile: %" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64
+                "] @ heap_v2/%zu\n",
+                totals[0], totals[1], totals[2], totals[3], profileRate);
+  }
+  for (size_t i = 0; profileStacks && i < PROFILE_STACKS; i++)
+  {
+    struct _profileStack *s = &profileStacks[i];
+    if (s->hash == 0 || (folded && s->liveBytes < 0.5))
+    {
+      continue;
+    }
+    if (folded)
+    {
+      for (int j = s->depth - 1; j >= 0; j--)
+      {
+        profileFrame(buf, sizeof(buf), &len, s->pcs[j]);
+        statsPrintf(buf, sizeof(buf), &len, j ? ";" : "");
+      }
+      statsPrintf(buf, sizeof(buf), &len, " %.0f\n", s->liveBytes);
+    }
+    else
+    {
+      statsPrintf(buf, sizeof(buf), &len,
+                  "%" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64 "] @",
+                  s->liveSamples, s->liveSampledBytes, s->allocSamples,
+                  s->allocSampledBytes);
+      for (int j = 0; j < s->depth; j++)
+      {
+        statsPrintf(buf, sizeof(buf), &len, " %p", s->pcs[j]);
+      }
+      statsPrintf(buf, sizeof(buf), &len, "\n");
+    }
+    if (len > sizeof(buf) - PROFILE_LINE)
+    {
+      statsWrite(fd, buf, len);
+      len = 0;
+    }
+  }
+  pthread_mutex_unlock(&profileLock);
+  tcache.inProfile = nested;
+
+  if (!folded)
+  {
+    statsPrintf(buf, sizeof(buf), &len, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    ssize_t n = 0;
+    do
+    {
+      statsWrite(fd, buf, len);
+      n = maps >= 0 ? read(maps, buf, sizeof(buf)) : 0;
+      len = n > 0 ? (size_t)n : 0;
+    } while (n > 0);
+    if (maps >= 0)
+    {
+      close(maps);
+    }
+  }
+  statsWrite(fd, buf, len);
+  close(fd);
+  return 0;
+}
+
+/* MALLOC_PROFILE_SIGNAL handler: only sem_post() is safe to call here */
+static void profileSignalled(int sig)
+{
+  (void)sig;
+  int saved = errno;
+  sem_post(&profileSem);
+  errno = saved;
+}
+
+/*
+ * \brief profileWorker
+ *
+ * Thread started with the first sample when MALLOC_PROFILE_SIGNAL is
+ * set.  Dumps the profile each time the signal arrives.
+ *
+ * \return never returns
+ */
+static void *profileWorker(void *arg)
+{
+  for (;;)
+  {
+    if (sem_wait(&profileSem) == 0)
+    {
+      malloc_profile_dump(NULL);
+    }
+  }
+  return arg;
+}
+
+/*
+ * \brief profileInit
+ *
+ * Reads the profiler's settings.  Called from heapInit().
+ *
+ * \return none
+ */
+static void profileInit(void)
+{
+  const char *env = getenv("MALLOC_PROFILE");
+  if (env == NULL || atoi(env) == 0)
+  {
+    return;
+  }
+  env = getenv("MALLOC_PROFILE_RATE");
+  long rate = env ? atol(env) : PROFILE_RATE;
+  profileFile = getenv("MALLOC_PROFILE_FILE");
+  env = getenv("MALLOC_PROFILE_SIGNAL");
+  if (env && atoi(env) > 0)
+  {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignalled;
+    action.sa_flags = SA_RESTART;
+    sem_init(&profileSem, 0, 0);
+    if (sigaction(atoi(env), &action, NULL) == 0)
+    {
+      profileSignal = atoi(env);
+    }
+  }
+  profileRate = rate > 0 ? (size_t)rate : PROFILE_RATE;
+}
+
+/*
+ * \brief profileAtExit
+ *
+ * Writes the profile when the process exits, if profiling.
+ *
+ * \return none
+ */
+static void profileAtExit(void)
+{
+  if (profileRate)
+  {
+    malloc_profile_dump(NULL);
+  }
+}
+
+/* Keep every arena lock consistent across fork() */
+static void forkPrepare(void)
+{
+  pthread_mutex_lock(&profileLock);
+  for (int i = 0; i < numArenas; i++)
+  {
+    pthread_mutex_lock(&arenas[i].lock);
+  }
+  pthread_mutex_lock(&sbrkLock);
+  pthread_mutex_lock(&slabLock);
+  pthread_mutex_lock(&threadCachesLock);
+}
+
+static void forkParent(void)
+{
+  pthread_mutex_unlock(&threadCachesLock);
+  pthread_mutex_unlock(&slabLock);
+  pthread_mutex_unlock(&sbrkLock);
+  for (int i = 0; i < numArenas; i++)
+  {
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  pthread_mutex_unlock(&profileLock);
+}
+
+static void forkChild(void)
+{
+  pthread_mutex_init(&sbrkLock, NULL);
+  pthread_mutex_init(&slabLock, NULL);
+  pthread_mutex_init(&threadCachesLock, NULL);
+  for (int i = 0; i < numArenas; i++)
+  {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  }
+  pthread_mutex_init(&profileLock, NULL);
+  /* The profile dump and event flush threads did not come along */
+  profileWorkerUp = false;
+  eventsOn = false;
+  pthread_mutex_init(&eventsFlushLock, NULL);
+}
+
+/*
+ * \brief heapInit
+ *
+ * One-time setup on the first malloc.  The calls made here may allocate,
+ * so heapState is claimed first and re-entrant calls go straight to the
+ * main arena until setup is finished.
+ *
+ * \return none
+ */
+static void heapInit(void)
+{
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&heapState, &expected, 1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+
+  static const char *const fitNames[] =
+  {
+    [FIT_FIRST] = "first", [FIT_NEXT] = "next", [FIT_BEST] = "best",
+    [FIT_WORST] = "worst", [FIT_ADAPTIVE] = "adaptive"
+  };
+  static const fitFunc fits[] =
+  {
+    [FIT_FIRST] = firstFit, [FIT_NEXT] = nextFit, [FIT_BEST] = bestFit,
+    [FIT_WORST] = worstFit, [FIT_ADAPTIVE] = adaptiveFit
+  };
+  const char *env = getenv("MALLOC_FIT");
+  for (int i = 0; env && i <= FIT_ADAPTIVE; i++)
+  {
+    if (strcmp(env, fitNames[i]) == 0)
+    {
+      fitPolicy = i;
+    }
+  }
+  for (int i = 0; i < MAX_ARENAS; i++)
+  {
+    arenas[i].find = fits[fitPolicy];
+  }
+
+  env = getenv("MALLOC_ARENAS");
+  long count = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (count < 1)
+  {
+    count = 1;
+  }
+  numArenas = count > MAX_ARENAS ? MAX_ARENAS : (int)count;
+
+  pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  env = getenv("MALLOC_MMAP_THRESHOLD");
+  if (env)
+  {
+    mmapThreshold = (size_t)atol(env);
+  }
+  env = getenv("MALLOC_TRIM_THRESHOLD");
+  if (env)
+  {
+    trimThreshold = (size_t)atol(env);
+  }
+
+  statsFile = getenv("MALLOC_STATS_FILE");
+  eventsInit();
+
+  env = getenv("MALLOC_HUGEPAGE");
+  hugePages = env && atoi(env) != 0;
+
+  /* Slabs are disabled if the range cannot be reserved */
+  if (hugePages)
+  {
+    slabBase = reserveAligned(SLAB_REGION);
+    slabCommit = HUGE_PAGE;
+  }
+  else
+  {
+    void *range = mmap(NULL, SLAB_REGION, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range != MAP_FAILED)
+    {
+      slabBase = range;
+    }
+  }
+
+  env = getenv("MALLOC_ARENA_POLICY");
+  if (env && strcmp(env, "rr") == 0)
+  {
+    arenaPolicy = ARENA_ROUND_ROBIN;
+  }
+
+  profileInit();
+
+  atexit( printStatistics );
+  pthread_key_create(&tcacheKey, tcacheDestroy);
+  pthread_atfork(forkPrepare, forkParent, forkChild);
+  __atomic_store_n(&heapState, 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * \brief quickFree
+ *
+ * Frees a _block that reached its arena.  Small _blocks go on the quick
+ * list for their size class as they are; anything else is coalesced
+ * right away by heapFree().  Called with the arena's lock held.
+ *
+ * \param a locked arena that owns b
+ * \param b the _block to free
+ *
+ * \return none
+ */
+static void quickFree(struct _arena *a, struct _block *b)
+{
+  size_t size = BLOCK_SIZE(b);
+  if (size >= QUICK_LIMIT)
+  {
+    heapFree(a, b);
+    return;
+  }
+  FREE_LINKS(b)->nextFree = a->quick[size >> 3];
+  a->quick[size >> 3] = b;
+  a->quickCount++;
+}
+
+/*
+ * \brief quickConsolidate
+ *
+ * Frees every _block on the arena's quick lists for real, coalescing
+ * each with its neighbours.  Called with the arena's lock held.
+ *
+ * \param a locked arena
+ *
+ * \return none
+ */
+static void quickConsolidate(struct _arena *a)
+{
+  for (int bin = 0; a->quickCount && bin < NUM_QUICK; bin++)
+  {
+    while (a->quick[bin])
+    {
+      struct _block *b = a->quick[bin];
+      a->quick[bin] = FREE_LINKS(b)->nextFree;
+      a->quickCount--;
+      heapFree(a, b);
+    }
+  }
+}
+
+/*
+ * \brief heapAlloc
+ *
+ * finds a free _block of heap memory for the calling process.
+ * if there is no free _block that satisfies the request then grows the
+ * heap and returns a new _block.  Called with the arena's lock held.
+ *
+ * \param a locked arena to allocate from
+ * \param size aligned payload size in bytes
+ * \param dirty if not NULL, set to how many leading bytes may be non-zero;
+ * the rest of the payload is known to read zero
+ *
+ * \return the _block, marked in use, or NULL if the heap could not grow
+ */
+static struct _block *heapAlloc(struct _arena *a, size_t size, size_t *dirty)
+{
+  /* An unmerged free of the same size class needs no search or split */
+  if (size < QUICK_LIMIT && a->quick[size >> 3])
+  {
+    struct _block *b = a->quick[size >> 3];
+    a->quick[size >> 3] = FREE_LINKS(b)->nextFree;
+    a->quickCount--;
+    a->num_quick_hits++;
+    a->num_mallocs++;
+    if (dirty)
+    {
+      *dirty = SIZE_MASK;
+    }
+    return b;
+  }
+
+  /* Look for free _block */
+  struct _block *next = findFreeBlock(a, size);
+
+  /* Merge the quick lists before a large request settles for the top,
+   * or before any request grows the heap */
+  if (next == NULL && a->quickCount &&
+      (size >= QUICK_LIMIT || a->top == NULL || BLOCK_SIZE(a->top) < size))
+  {
+    quickConsolidate(a);
+    next = findFreeBlock(a, size);
+  }
+
+  /* Could not find free _block, so cut it from the top */
+  if (next == NULL)
+  {
+    next = topAlloc(a, size, dirty);
+  }
+  else
+  {
+    removeFree(a, next);
+    if (dirty)
+    {
+      *dirty = SIZE_MASK;
+    }
+    /* Only the links and the footer of a released _block are non-zero */
+    if (IS_ZEROED(next))
+    {
+      BLOCK_FOOTER(next) = 0;
+      if (dirty)
+      {
+        *dirty = (char *)(TREE_LINKS(next) + 1) - (char *)BLOCK_DATA(next);
+      }
+    }
+    splitBlock(a, next, size);
+    markUsed(next);
+    a->num_reuses++;
+  }
+  /* Could not find free _block or grow heap, so just return NULL */
+  if (next == NULL)
+  {
+    return NULL;
+  }
+
+  a->num_mallocs++;
+  return next;
+}
+
+/*
+ * \brief heapFree
+ *
+ * Marks a _block free, coalesces it with free physical neighbours and puts
+ * the result back on the free list for its size class.  Called with the
+ * owning arena's lock held.  The caller counts the free, since _blocks
+ * flushed from a thread cache were already counted when cached.
+ *
+ * \param a locked arena that owns curr
+ * \param curr the _block to free
+ *
+ * \return none
+ */
+static void heapFree(struct _arena *a, struct _block *curr)
+{
+  assert(!IS_FREE(curr));
+  a->num_blocks++;
+
+  // merge with the block ahead if it is free
+  struct _block *next = BLOCK_NEXT(curr);
+  if(IS_FREE(next))
+  {
+    if(next == a->top)
+    {
+      a->top = curr;
+    }
+    else
+    {
+      removeFree(a, next);
+    }
+    absorbNext(a, curr);
+  }
+  // merge into the block behind if it is free, found through its footer
+  if(IS_PREV_FREE(curr))
+  {
+    struct _block *prev = BLOCK_PREV(curr);
+    if(curr == a->top)
+    {
+      a->top = prev;
+    }
+    curr = prev;
+    removeFree(a, curr);
+    absorbNext(a, curr);
+  }
+  curr->head &= ~BLOCK_ZEROED;
+  markFree(curr);
+  // the top stays off the free lists
+  if(curr == a->top)
+  {
+    if(BLOCK_SIZE(curr) >= trimThreshold)
+    {
+      trimTop(a, MIN_GROW);
+    }
+    return;
+  }
+  insertFree(a, curr);
+  if(BLOCK_SIZE(curr) >= trimThreshold)
+  {
+    releaseSpan(a, curr);
+  }
+}
+
+/*
+ * \brief heapResize
+ *
+ * Resizes an allocated _block without moving its data elsewhere.  A
+ * shrink gives the tail back through heapFree().  A grow takes a free
+ * next _block, or cuts into the top (growing the heap if the top is too
+ * small), or finally slides the data back into a free previous _block
+ * with memmove(), taking a free next _block too if that is needed.
+ * Whatever is left over past size bytes is split off again.  Called with
+ * the owning arena's lock held.
+ *
+ * \param a locked arena that owns b
+ * \param b allocated _block
+ * \param size new aligned payload size in bytes
+ *
+ * \return the resized _block, which is b or the _block in front of it,
+ * or NULL if it cannot be resized in place
+ */
+static struct _block *heapResize(struct _arena *a, struct _block *b,
+                                 size_t size)
+{
+  size_t old_size = BLOCK_SIZE(b);
+
+  /* Shrink: free the tail, which coalesces with whatever follows */
+  if (size <= old_size)
+  {
+    struct _block *tail = carveBlock(b, size);
+    if (tail)
+    {
+      markUsed(tail);
+      a->num_splits++;
+      EVENT(EVENT_SPLIT, 0, b, BLOCK_SIZE(b), BLOCK_SIZE(tail),
+            (int)(a - arenas));
+      heapFree(a, tail);
+    }
+    return b;
+  }
+
+  /* Grow into the top, extending the heap if the top is too small */
+  struct _block *next = BLOCK_NEXT(b);
+  if (next == a->top &&
+      old_size + sizeof(struct _block) + BLOCK_SIZE(next) < size)
+  {
+    growHeap(a, size - old_size);
+    next = BLOCK_NEXT(b);
+  }
+  if (next == a->top &&
+      old_size + sizeof(struct _block) + BLOCK_SIZE(next) >= size)
+  {
+    a->top = NULL;
+    absorbNext(a, b);
+    a->num_blocks++;  /* The top was never counted as a free _block */
+    a->top = carveBlock(b, size);
+    if (a->top && a->topClean < (char *)BLOCK_DATA(a->top))
+    {
+      a->topClean = (char *)BLOCK_DATA(a->top);
+    }
+    markUsed(b);
+    return b;
+  }
+
+  /* Grow into a free next _block */
+  size_t avail = old_size;
+  bool useNext = IS_FREE(next) && next != a->top;
+  if (useNext)
+  {
+    avail = avail + sizeof(struct _block) + BLOCK_SIZE(next);
+    if (avail >= size)
+    {
+      removeFree(a, next);
+      absorbNext(a, b);
+      splitBlock(a, b, size);
+      markUsed(b);
+      return b;
+    }
+  }
+
+  /* Grow backwards into a free previous _block */
+  if (IS_PREV_FREE(b))
+  {
+    struct _block *prev = BLOCK_PREV(b);
+    if (BLOCK_SIZE(prev) + sizeof(struct _block) + avail >= size)
+    {
+      removeFree(a, prev);
+      prev->head &= ~BLOCK_ZEROED;
+      if (useNext)
+      {
+        removeFree(a, next);
+        absorbNext(a, b);
+      }
+      absorbNext(a, prev);
+      memmove(BLOCK_DATA(prev), BLOCK_DATA(b), old_size);
+      splitBlock(a, prev, size);
+      markUsed(prev);
+      return prev;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * \brief pushRemoteFree
+ *
+ * Hands a _block to an arena the calling thread is not bound to, without
+ * taking its lock.  The free is counted by the calling thread.
+ *
+ * \param a arena that owns b
+ * \param b the _block to free
+ *
+ * \return none
+ */
+static inline void pushRemoteFree(struct _arena *a, struct _block *b)
+{
+  struct _block *head = __atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED);
+  do
+  {
+    FREE_LINKS(b)->nextFree = head;
+  } while (!__atomic_compare_exchange_n(&a->remoteFrees, &head, b, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * \brief drainRemoteFrees
+ *
+ * Takes every _block other threads have pushed onto the arena's remote
+ * stack and frees them in one batch.  Called with the arena's lock held.
+ *
+ * \param a locked arena
+ *
+ * \return none
+ */
+static void drainRemoteFrees(struct _arena *a)
+{
+  if (__atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED) == NULL)
+  {
+    return;
+  }
+  struct _block *b = __atomic_exchange_n(&a->remoteFrees, NULL,
+                                         __ATOMIC_ACQUIRE);
+  while (b)
+  {
+    struct _block *next = FREE_LINKS(b)->nextFree;
+    quickFree(a, b);
+    a->num_remote_frees++;
+    b = next;
+  }
+}
+
+/*
+ * \brief pageAlign
+ *
+ * \return size rounded up to a whole number of pages
+ */
+static inline size_t pageAlign(size_t size)
+{
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+/*
+ * A mapped _block's header sits in the first page of its mapping and its
+ * payload runs to the end of the last page, so the mapping is always the
+ * pages the _block touches.
+ */
+static inline char *mappingStart(struct _block *b)
+{
+  return (char *)((uintptr_t)b & ~(pageSize - 1));
+}
+
+static inline size_t mappingSize(struct _block *b)
+{
+  return pageAlign((uintptr_t)BLOCK_END(b)) - (uintptr_t)mappingStart(b);
+}
+
+/*
+ * \brief mmapAlloc
+ *
+ * Serves a large request from a private anonymous mapping.  The payload
+ * starts at the first alignment boundary past the header, whole pages
+ * in front of the header and past the request are unmapped again, and
+ * everything up to the end of the mapping is usable payload.
+ *
+ * \param size requested payload size in bytes
+ * \param alignment payload alignment, a power of two of at least ALIGNMENT
+ *
+ * \return the new _block or NULL if the mapping failed
+ */
+static struct _block *mmapAlloc(size_t size, size_t alignment)
+{
+  size_t length = pageAlign(size + alignment);
+  char *map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+  {
+    return NULL;
+  }
+  uintptr_t data = ((uintptr_t)map + ALIGNMENT + alignment - 1) &
+                   ~(uintptr_t)(alignment - 1);
+  struct _block *b = (struct _block *)data - 1;
+  char *start = mappingStart(b);
+  char *end = (char *)pageAlign(data + size);
+  if (start > map)
+  {
+    munmap(map, start - map);
+  }
+  if (end < map + length)
+  {
+    munmap(end, map + length - end);
+  }
+  b->head = ((uintptr_t)end - data) | BLOCK_MMAPPED;
+  __atomic_add_fetch(&num_mmaps, 1, __ATOMIC_RELAXED);
+  return b;
+}
+
+/*
+ * \brief mmapRealloc
+ *
+ * Resizes a mapped _block with mremap(), letting the kernel move the pages
+ * instead of copying them.
+ *
+ * \param b mapped _block
+ * \param size new payload size in bytes
+ *
+ * \return the (possibly moved) _block, or NULL if the mapping could not
+ * be resized, in which case b is untouched
+ */
+static struct _block *mmapRealloc(struct _block *b, size_t size)
+{
+  char *start = mappingStart(b);
+  size_t offset = (char *)b - start;
+  size_t oldLength = mappingSize(b);
+  size_t length = pageAlign(offset + sizeof(struct _block) + size);
+  if (length == oldLength)
+  {
+    return b;
+  }
+  char *map = mremap(start, oldLength, length, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED)
+  {
+    return NULL;
+  }
+  struct _block *moved = (struct _block *)(map + offset);
+  moved->head = (length - offset - sizeof(struct _block)) | BLOCK_MMAPPED;
+  return moved;
+}
+
+/*
+ * \brief slabNew
+ *
+ * Sets up an empty slab of one class for an arena, reusing an emptied
+ * slab if there is one and carving a fresh page from the range if not.
+ *
+ * \param a locked arena that will own the slab
+ * \param cls slab class
+ *
+ * \return the slab or NULL if the range is used up
+ */
+static struct _slab *slabNew(struct _arena *a, int cls)
+{
+  pthread_mutex_lock(&slabLock);
+  struct _slab *s = emptySlabs;
+  if (s)
+  {
+    emptySlabs = s->nextSlab;
+  }
+  else if (slabCarved < SLAB_REGION)
+  {
+    if (slabCarved == slabCommitted)
+    {
+      if (mprotect(slabBase + slabCommitted, slabCommit,
+                   PROT_READ | PROT_WRITE) == 0)
+      {
+        slabCommitted = slabCommitted + slabCommit;
+      }
+    }
+    if (slabCarved < slabCommitted)
+    {
+      s = (struct _slab *)(slabBase + slabCarved);
+      slabCarved = slabCarved + SLAB_SIZE;
+      num_slabs++;
+    }
+  }
+  pthread_mutex_unlock(&slabLock);
+
+  if (s == NULL)
+  {
+    return NULL;
+  }
+
+  s->size  = (unsigned short)(cls ? cls * ALIGNMENT : 8);
+  s->cls   = (unsigned char)cls;
+  s->slots = (unsigned short)((SLAB_SIZE - SLAB_SLOTS) / s->size);
+  s->used  = 0;
+  s->arena = (unsigned char)(a - arenas);
+  memset(s->bitmap, 0, sizeof(s->bitmap));
+  for (int w = 0; w < s->slots / 64; w++)
+  {
+    s->bitmap[w] = ~(uint64_t)0;
+  }
+  if (s->slots % 64)
+  {
+    s->bitmap[s->slots / 64] = ((uint64_t)1 << (s->slots % 64)) - 1;
+  }
+
+  s->prevSlab = NULL;
+  s->nextSlab = a->slabs[cls];
+  if (s->nextSlab)
+  {
+    s->nextSlab->prevSlab = s;
+  }
+  a->slabs[cls] = s;
+  s->listed = true;
+  return s;
+}
+
+/*
+ * \brief slabUnlink
+ *
+ * Takes a slab off its arena's class list.
+ *
+ * \param a locked arena that owns s
+ * \param s listed slab
+ *
+ * \return none
+ */
+static void slabUnlink(struct _arena *a, struct _slab *s)
+{
+  if (s->prevSlab)
+  {
+    s->prevSlab->nextSlab = s->nextSlab;
+  }
+  else
+  {
+    a->slabs[s->cls] = s->nextSlab;
+  }
+  if (s->nextSlab)
+  {
+    s->nextSlab->prevSlab = s->prevSlab;
+  }
+  s->listed = false;
+}
+
+/*
+ * \brief slabAlloc
+ *
+ * Hands out the lowest free slot of the first slab on the class list.
+ * A slab that fills up leaves the list.
+ *
+ * \param a locked arena
+ * \param cls slab class
+ *
+ * \return the slot or NULL if no slab could be set up
+ */
+static void *slabAlloc(struct _arena *a, int cls)
+{
+  struct _slab *s = a->slabs[cls];
+  if (s == NULL && (s = slabNew(a, cls)) == NULL)
+  {
+    return NULL;
+  }
+  int w = 0;
+  while (s->bitmap[w] == 0)
+  {
+    w++;
+  }
+  int slot = w * 64 + __builtin_ctzll(s->bitmap[w]);
+  s->bitmap[w] &= s->bitmap[w] - 1;
+  if (++s->used == s->slots)
+  {
+    slabUnlink(a, s);
+  }
+  return (char *)s + SLAB_SLOTS + (size_t)slot * s->size;
+}
+
+/*
+ * \brief slabFree
+ *
+ * Marks a slot free again.  A full slab goes back on its class list, and
+ * a slab that empties is given up unless it is the only one of its class.
+ *
+ * \param a locked arena that owns s
+ * \param s slab holding ptr
+ * \param ptr the slot
+ *
+ * \return none
+ */
+static void slabFree(struct _arena *a, struct _slab *s, void *ptr)
+{
+  unsigned slot = (unsigned)(((char *)ptr - (char *)s - SLAB_SLOTS) / s->size);
+  assert(!(s->bitmap[slot / 64] & ((uint64_t)1 << (slot % 64))));
+  s->bitmap[slot / 64] |= (uint64_t)1 << (slot % 64);
+  s->used--;
+
+  int cls = s->cls;
+  if (!s->listed)
+  {
+    s->prevSlab = NULL;
+    s->nextSlab = a->slabs[cls];
+    if (s->nextSlab)
+    {
+      s->nextSlab->prevSlab = s;
+    }
+    a->slabs[cls] = s;
+    s->listed = true;
+  }
+  else if (s->used == 0 && (s->prevSlab || s->nextSlab))
+  {
+    slabUnlink(a, s);
+    pthread_mutex_lock(&slabLock);
+    s->nextSlab = emptySlabs;
+    emptySlabs = s;
+    pthread_mutex_unlock(&slabLock);
+  }
+}
+
+/*
+ * \brief slotRefill
+ *
+ * After a miss, moves the free slots of one bitmap word of the class's
+ * first slab into the calling thread's cache.  Called with the arena's
+ * lock held.
+ *
+ * \param a locked arena
+ * \param cls slab class that missed
+ *
+ * \return none
+ */
+static void slotRefill(struct _arena *a, int cls)
+{
+  struct _slab *s = a->slabs[cls];
+  if (s == NULL || !tcache.registered)
+  {
+    return;
+  }
+  int w = 0;
+  while (s->bitmap[w] == 0)
+  {
+    w++;
+  }
+  uint64_t bits = s->bitmap[w];
+  int room = TCACHE_COUNT - tcache.slotCounts[cls];
+  while (__builtin_popcountll(bits) > room)
+  {
+    bits &= bits - 1;
+  }
+  s->bitmap[w] &= ~bits;
+  s->used = (unsigned short)(s->used + __builtin_popcountll(bits));
+  if (s->used == s->slots)
+  {
+    slabUnlink(a, s);
+  }
+  while (bits)
+  {
+    void *ptr = (char *)s + SLAB_SLOTS +
+                (size_t)(w * 64 + __builtin_ctzll(bits)) * s->size;
+    bits &= bits - 1;
+    *(void **)ptr = tcache.slots[cls];
+    tcache.slots[cls] = ptr;
+    tcache.slotCounts[cls]++;
+  }
+}
+
+/*
+ * \brief allocate
+ *
+ * Serves small requests from the calling thread's cache when it can,
+ * otherwise allocates from the thread's arena under its lock.
+ *
+ * \param size size of the requested memory in bytes
+ * \param dirty if not NULL, lowered to how many leading bytes may be
+ * non-zero when the rest is known to read zero
+ *
+ * \return returns the requested memory allocation or NULL if failed
+ */
+static inline void *allocate(size_t size, size_t *dirty)
+{
+  if (heapState != 2)
+  {
+    heapInit();
+  }
+
+  /* Handle 0 size and requests sbrk() cannot express */
+  if (size == 0 || size > MAX_REQUEST)
+  {
+    return NULL;
+  }
+  THREAD_COUNT(sizes[63 - __builtin_clzll(size)], 1);
+
+  /* Large requests get their own mapping */
+  if (size >= mmapThreshold)
+  {
+    struct _block *b = mmapAlloc(size, ALIGNMENT);
+    if (b == NULL)
+    {
+      return NULL;
+    }
+    THREAD_COUNT(mallocs, 1);
+    THREAD_COUNT(requested, size);
+    if (dirty)
+    {
+      *dirty = 0;
+    }
+    return BLOCK_DATA(b);
+  }
+
+  /* Tiny requests are served from slabs */
+  if (size <= SLAB_LIMIT && slabBase)
+  {
+    int cls = slabClass(size);
+    void *ptr = tcache.slots[cls];
+    if (ptr && tcacheUsable())
+    {
+      tcache.slots[cls] = *(void **)ptr;
+      tcache.slotCounts[cls]--;
+      THREAD_COUNT(mallocs, 1);
+      THREAD_COUNT(hits, 1);
+      THREAD_COUNT(requested, size);
+      return ptr;
+    }
+    struct _arena *a = lockArena(threadArenaBind());
+    ptr = slabAlloc(a, cls);
+    if (ptr)
+    {
+      a->num_mallocs++;
+      a->num_requested = a->num_requested + size;
+      if (tcacheUsable())
+      {
+        slotRefill(a, cls);
+      }
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (ptr)
+    {
+      return ptr;
+    }
+  }
+
+  /* Align the payload and leave room for the free links */
+  size_t aligned = ALIGN_PAYLOAD(size);
+  if (aligned < MIN_PAYLOAD)
+  {
+    aligned = MIN_PAYLOAD;
+  }
+
+  int bin = sizeToBin(aligned);
+  bool cached = aligned < SMALL_LIMIT && tcacheUsable();
+  if (cached && tcache.entries[bin])
+  {
+    struct _block *b = tcache.entries[bin];
+    tcache.entries[bin] = FREE_LINKS(b)->nextFree;
+    tcache.counts[bin]--;
+    THREAD_COUNT(mallocs, 1);
+    THREAD_COUNT(hits, 1);
+    THREAD_COUNT(requested, size);
+    return BLOCK_DATA(b);
+  }
+
+  struct _arena *a = lockArena(threadArenaBind());
+  drainRemoteFrees(a);
+  a->num_requested = a->num_requested + size;
+  struct _block *next = heapAlloc(a, aligned, dirty);
+  if (cached)
+  {
+    tcacheRefill(a, bin);
+  }
+  pthread_mutex_unlock(&a->lock);
+
+  /* Return data address associated with _block */
+  return next ? BLOCK_DATA(next) : NULL;
+}
+
+/*
+ * \brief malloc
+ *
+ * \param size size of the requested memory in bytes
+ *
+ * \return returns the requested memory allocation to the calling process
+ * or NULL if failed
+ */
+void *malloc(size_t size)
+{
+  uint64_t start = EVENT_START();
+  void *ptr = allocate(size, NULL);
+  PROFILE_ALLOC(ptr, size);
+  EVENT_CALL(EVENT_MALLOC, start, ptr, size, 0);
+  return ptr;
+}
+
+/*
+ * \brief calloc
+ *
+ * Allocates nmemb * size bytes and clears them.  Memory fresh from the
+ * kernel, whether a new mapping, the untouched end of the top or a span
+ * released by a trim, already reads zero and is not cleared again, so a
+ * large zeroed buffer costs no more than its page faults.  What does need
+ * clearing goes through memset(), which the C library vectorizes.
+ *
+ * \param nmemb number of elements
+ * \param size size of each element in bytes
+ *
+ * \return returns the zeroed memory or NULL if failed or the size overflows
+ */
+void* calloc(size_t nmemb, size_t size)
+{
+  size_t total_size;
+  if (__builtin_mul_overflow(nmemb, size, &total_size))
+  {
+    return NULL;
+  }
+  uint64_t start = EVENT_START();
+  size_t dirty = total_size;
+  void *ptr = allocate(total_size, &dirty);
+  PROFILE_ALLOC(ptr, total_size);
+
+  /* Cached and reused _blocks are dirty, clear only what may be */
+  if (ptr && dirty)
+  {
+    memset(ptr, 0, dirty < total_size ? dirty : total_size);
+  }
+  EVENT_CALL(EVENT_CALLOC, start, ptr, total_size, 0);
+  return ptr;
+}
+
+/*
+ * \brief reallocate
+ *
+ * Body of realloc(), always inlined so that the heap profiler's
+ * backtraces start at realloc()'s caller.
+ *
+ * \return the resized memory, ptr itself if it was resized in place, or
+ * NULL if it could not be resized
+ */
+static inline __attribute__((always_inline)) void *reallocate(void *ptr,
+                                                              size_t size)
+{
+  if (ptr == NULL)
+  {
+    ptr = allocate(size, NULL);
+    PROFILE_ALLOC(ptr, size);
+    return ptr;
+  }
+  if (size == 0)
+  {
+    free(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST)
+  {
+    return NULL;
+  }
+  // a slot cannot change class, only move, so free_sized() finds it again
+  if(isSlot(ptr))
+  {
+    size_t old_size = SLAB_OF(ptr)->size;
+    if(size <= old_size && slabClass(size) == SLAB_OF(ptr)->cls)
+    {
+      return ptr;
+    }
+    void *new_ptr = allocate(size, NULL);
+    PROFILE_ALLOC(new_ptr, size);
+    if(new_ptr)
+    {
+      memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+      free(ptr);
+    }
+    return new_ptr;
+  }
+  struct _block *header = BLOCK_HEADER(ptr);
+  size_t new_size = ALIGN_PAYLOAD(size);
+  // a mapped block is resized in place or moved by the kernel
+  if(IS_MMAPPED(header))
+  {
+    struct _block *moved = mmapRealloc(header, new_size);
+    if(moved)
+    {
+      PROFILE_MOVE(ptr, BLOCK_DATA(moved), size);
+      return BLOCK_DATA(moved);
+    }
+  }
+  if(new_size < MIN_PAYLOAD)
+  {
+    new_size = MIN_PAYLOAD;
+  }
+  // the current block is already big enough and too close in size to split
+  size_t old_size = BLOCK_SIZE(header);
+  if(new_size <= old_size &&
+     (IS_MMAPPED(header) ||
+      old_size < new_size + sizeof(struct _block) + MIN_PAYLOAD))
+  {
+    return ptr;
+  }
+  // shrink, or grow into free neighbours or the top, without copying
+  if(!IS_MMAPPED(header))
+  {
+    struct _arena *a = lockArena(&arenas[BLOCK_ARENA(header)]);
+    struct _block *resized = heapResize(a, header, new_size);
+    pthread_mutex_unlock(&a->lock);
+    if(resized)
+    {
+      PROFILE_MOVE(ptr, BLOCK_DATA(resized), size);
+      return BLOCK_DATA(resized);
+    }
+  }
+  // none of the above conditions valid
+  // create new block with the size
+  // copy the data from the previous block
+  // free the previous block;
+  void *new_ptr = allocate(size, NULL);
+  PROFILE_ALLOC(new_ptr, size);
+  if(new_ptr)
+  {
+    memcpy(new_ptr, ptr, old_size);
+    free(ptr);
+  }
+  return new_ptr;
+}
+
+/*
+ * \brief realloc
+ *
+ * \param ptr memory to resize, or NULL to allocate
+ * \param size new size in bytes, or 0 to free ptr
+ *
+ * \return the resized memory or NULL if failed
+ */
+void* realloc(void *ptr, size_t size)
+{
+  uint64_t start = EVENT_START();
+  void *moved = reallocate(ptr, size);
+  EVENT_CALL(EVENT_REALLOC, start, moved, size, ptr);
+  return moved;
+}
+
+/*
+ * \brief deallocate
+ *
+ * frees the memory _block pointed to by pointer.  A _block owned by an
+ * arena other than the calling thread's is pushed onto that arena's
+ * remote stack.  Otherwise small _blocks go onto the calling thread's
+ * cache, and when that is full half of it is first returned to the arena.
+ * Everything else goes straight back to the arena under its lock.
+ *
+ * \param ptr the heap memory to free
+ *
+ * \return none
+ */
+static inline void deallocate(void *ptr)
+{
+  if (ptr == NULL)
+  {
+    return;
+  }
+  PROFILE_FREE(ptr);
+
+  if (isSlot(ptr))
+  {
+    struct _slab *s = SLAB_OF(ptr);
+    int cls = s->cls;
+    if (tcacheUsable())
+    {
+      tcacheRegister();
+      if (tcache.slotCounts[cls] == TCACHE_COUNT)
+      {
+        slotFlush(cls, TCACHE_COUNT / 2);
+      }
+      *(void **)ptr = tcache.slots[cls];
+      tcache.slots[cls] = ptr;
+      tcache.slotCounts[cls]++;
+      THREAD_COUNT(frees, 1);
+      return;
+    }
+    struct _arena *a = lockArena(&arenas[s->arena]);
+    a->num_frees++;
+    slabFree(a, s, ptr);
+    pthread_mutex_unlock(&a->lock);
+    return;
+  }
+
+  struct _block *curr = BLOCK_HEADER(ptr);
+  assert(!IS_FREE(curr));
+
+  if (IS_MMAPPED(curr))
+  {
+    munmap(mappingStart(curr), mappingSize(curr));
+    THREAD_COUNT(frees, 1);
+    return;
+  }
+
+  struct _arena *owner = &arenas[BLOCK_ARENA(curr)];
+  if (owner != threadArenaBind())
+  {
+    pushRemoteFree(owner, curr);
+    THREAD_COUNT(frees, 1);
+    return;
+  }
+
+  if (BLOCK_SIZE(curr) < SMALL_LIMIT && tcacheUsable())
+  {
+    int bin = sizeToBin(BLOCK_SIZE(curr));
+    tcacheRegister();
+    if (tcache.counts[bin] == TCACHE_COUNT)
+    {
+      tcacheFlush(bin, TCACHE_COUNT / 2);
+    }
+    FREE_LINKS(curr)->nextFree = tcache.entries[bin];
+    tcache.entries[bin] = curr;
+    tcache.counts[bin]++;
+    THREAD_COUNT(frees, 1);
+    return;
+  }
+
+  struct _arena *a = lockArena(owner);
+  a->num_frees++;
+  quickFree(a, curr);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * \brief free
+ *
+ * \param ptr the heap memory to free, or NULL
+ *
+ * \return none
+ */
+void free(void *ptr)
+{
+  uint64_t start = EVENT_START();
+  deallocate(ptr);
+  if (ptr)
+  {
+    EVENT_CALL(EVENT_FREE, start, ptr, 0, 0);
+  }
+}
+
+
+/*
+ * \brief free_sized
+ *
+ * Frees memory whose requested size the caller knows.  A slot is cached
+ * straight away under its slab's class, which for slots from the aligned
+ * entry points can be larger than the size implies.  Anything else needs
+ * its header anyway and is handed to free().
+ *
+ * \param ptr the memory to free
+ * \param size the size it was allocated or last reallocated with
+ *
+ * \return none
+ */
+void free_sized(void *ptr, size_t size)
+{
+  if (size != 0 && size <= SLAB_LIMIT && isSlot(ptr) && tcacheUsable())
+  {
+    uint64_t start = EVENT_START();
+    int cls = SLAB_OF(ptr)->cls;
+    PROFILE_FREE(ptr);
+    tcacheRegister();
+    if (tcache.slotCounts[cls] == TCACHE_COUNT)
+    {
+      slotFlush(cls, TCACHE_COUNT / 2);
+    }
+    *(void **)ptr = tcache.slots[cls];
+    tcache.slots[cls] = ptr;
+    tcache.slotCounts[cls]++;
+    THREAD_COUNT(frees, 1);
+    EVENT_CALL(EVENT_FREE, start, ptr, size, 0);
+    return;
+  }
+  free(ptr);
+}
 
 /*
- *  \brief printStatistics
- *
- *  \param none
- *
- *  Prints the heap statistics upon process exit.  Registered
- *  via atexit()
- *
- *  \return none
+ * C++14 sized deallocation, operator delete(void *, std::size_t) and
+ * operator delete[](void *, std::size_t) by their mangled names.  The
+ * size is the one operator new was called with.
  */
-void printStatistics( void )
+void _ZdlPvm(void *ptr, size_t size)
 {
-  printf("\nheap management statistics\n");
-  printf("mallocs:\t%d\n", num_mallocs );
-  printf("frees:\t\t%d\n", num_frees );
-  printf("reuses:\t\t%d\n", num_reuses );
-  printf("grows:\t\t%d\n", num_grows );
-  printf("splits:\t\t%d\n", num_splits );
-  printf("coalesces:\t%d\n", num_coalesces );
-  printf("blocks:\t\t%d\n", num_blocks );
-  printf("requested:\t%d\n", num_requested );
-  printf("max heap:\t%d\n", max_heap );
-}
-
-struct _block 
-{
-   size_t  size;         /* Size of the allocated _block of memory in bytes */
-   struct _block *prev;  /* Pointer to the previous _block of allcated memory   */
-   struct _block *next;  /* Pointer to the next _block of allcated memory   */
-   bool   free;          /* Is this _block free?                     */
-   char   padding[3];
-};
-
+  free_sized(ptr, size);
+}
 
-struct _block *heapList = NULL; /* Free list to track the _blocks available */
+void _ZdaPvm(void *ptr, size_t size)
+{
+  free_sized(ptr, size);
+}
 
 /*
- * \brief findFreeBlock
+ * \brief malloc_batch
  *
- * \param last pointer to the linked list of free _blocks
- * \param size size of the _block needed in bytes 
+ * Allocates n objects of size bytes each under a single lock acquisition.
+ * Heap objects are cut one after another from one span found with a
+ * single search; tiny ones come from the arena's slabs.  If no span that
+ * big can be had the rest are allocated one at a time.
  *
- * \return a _block that fits the request or NULL if no free _block matches
+ * \param size size of each object in bytes
+ * \param n number of objects wanted
+ * \param ptrs receives the objects
  *
- * \TODO Implement Next Fit
- * \TODO Implement Best Fit
- * \TODO Implement Worst Fit
+ * \return number of objects allocated, fewer than n only if memory ran out
  */
-struct _block *findFreeBlock(struct _block **last, size_t size) 
+size_t malloc_batch(size_t size, size_t n, void **ptrs)
 {
-   struct _block *curr = heapList;
-#if defined FIT && FIT == 0
-   /* First fit */
-  while (curr && !(curr->free && curr->size >= size)) 
+  if (heapState != 2)
   {
-    *last = curr;
-    curr = curr->next;
+    heapInit();
+  }
+  if (size == 0 || size > MAX_REQUEST || n == 0)
+  {
+    return 0;
   }
-#endif
 
-#if defined BEST && BEST == 0
-  struct _block *retBlock = NULL;
-  struct _block *prevBlock = NULL;
-  while(curr != NULL)
+  /* Large objects get their own mappings anyway */
+  size_t count = 0;
+  if (size >= mmapThreshold)
   {
-    if(curr->free == 1 && curr->size >= size)
-    { 
-      if(retBlock == NULL || (retBlock && retBlock->size > curr->size))
-      {
-        retBlock = curr;
-        prevBlock = *last;
-      }
+    while (count < n && (ptrs[count] = allocate(size, NULL)) != NULL)
+    {
+      PROFILE_ALLOC(ptrs[count], size);
+      count++;
     }
-    *last = curr;
-    curr = curr->next;
+    return count;
   }
-  if(retBlock)
+
+  struct _arena *a = lockArena(threadArenaBind());
+  drainRemoteFrees(a);
+  if (size <= SLAB_LIMIT && slabBase)
   {
-    curr = retBlock;
-    *last = prevBlock;
+    int cls = slabClass(size);
+    while (count < n && (ptrs[count] = slabAlloc(a, cls)) != NULL)
+    {
+      count++;
+    }
+    a->num_mallocs = a->num_mallocs + count;
   }
-#endif
 
-#if defined WORST && WORST == 0
-  struct _block *retBlock = NULL;
-  struct _block *prevBlock = NULL;
-  while(curr != NULL)
+  size_t aligned = ALIGN_PAYLOAD(size);
+  if (aligned < MIN_PAYLOAD)
+  {
+    aligned = MIN_PAYLOAD;
+  }
+  size_t stride = aligned + sizeof(struct _block);
+  size_t span;
+  if (count < n && !__builtin_mul_overflow(n - count, stride, &span) &&
+      span - sizeof(struct _block) <= MAX_REQUEST)
   {
-    if(curr->free == 1 && curr->size >= size)
+    struct _block *b = heapAlloc(a, span - sizeof(struct _block), NULL);
+    if (b)
     {
-      if(retBlock == NULL || (retBlock && retBlock->size < curr->size))
+      a->num_mallocs = a->num_mallocs + (n - count - 1);
+      for (; count < n - 1; count++)
       {
-        retBlock = curr;
-        prevBlock = *last;
+        struct _block *rest = carveBlock(b, aligned);
+        markUsed(rest);
+        ptrs[count] = BLOCK_DATA(b);
+        b = rest;
       }
+      ptrs[count++] = BLOCK_DATA(b);
     }
-    *last = curr;
-    curr = curr->next;
   }
-  if(retBlock)
-  {
-    curr = retBlock;
-    *last = prevBlock;
-  }
-#endif
-
-#if defined NEXT && NEXT == 0
-  struct _block *start = NULL;
-  if(*last && (*last)->next)
+  while (count < n)
   {
-    start = (*last)->next->next;
+    struct _block *b = heapAlloc(a, aligned, NULL);
+    if (b == NULL)
+    {
+      break;
+    }
+    ptrs[count++] = BLOCK_DATA(b);
   }
-  curr = start;
-  while(curr && !(curr->free && curr->size >= size))
+  a->num_requested = a->num_requested + size * count;
+  pthread_mutex_unlock(&a->lock);
+  for (size_t i = 0; i < count; i++)
   {
-    *last = curr;
-    curr = curr->next;
+    PROFILE_ALLOC(ptrs[i], size);
   }
-  if(curr == NULL)
+  return count;
+}
+
+/*
+ * \brief free_batch
+ *
+ * Frees n objects, taking each arena's lock once for a run of objects
+ * it owns instead of once per object.  Objects go straight back to their
+ * arenas, bypassing the thread cache.  NULL entries are skipped.
+ *
+ * \param ptrs objects to free
+ * \param n number of entries in ptrs
+ *
+ * \return none
+ */
+void free_batch(void **ptrs, size_t n)
+{
+  struct _arena *locked = NULL;
+  for (size_t i = 0; i < n; i++)
   {
-    curr = heapList;
-    while(curr && !(curr->free && curr->size >= size))
+    void *ptr = ptrs[i];
+    if (ptr == NULL)
+    {
+      continue;
+    }
+    PROFILE_FREE(ptr);
+
+    struct _block *b = NULL;
+    struct _arena *a;
+    if (isSlot(ptr))
+    {
+      a = &arenas[SLAB_OF(ptr)->arena];
+    }
+    else
+    {
+      b = BLOCK_HEADER(ptr);
+      assert(!IS_FREE(b));
+      if (IS_MMAPPED(b))
+      {
+        munmap(mappingStart(b), mappingSize(b));
+        THREAD_COUNT(frees, 1);
+        continue;
+      }
+      a = &arenas[BLOCK_ARENA(b)];
+    }
+
+    if (a != locked)
+    {
+      if (locked)
+      {
+        pthread_mutex_unlock(&locked->lock);
+      }
+      locked = lockArena(a);
+    }
+    a->num_frees++;
+    if (b)
+    {
+      quickFree(a, b);
+    }
+    else
     {
-      *last = curr;
-      curr = curr->next;
+      slabFree(a, SLAB_OF(ptr), ptr);
     }
   }
-#endif
-  if(curr != NULL)
+  if (locked)
   {
-    num_blocks--;
+    pthread_mutex_unlock(&locked->lock);
   }
-  return curr;
 }
 
 /*
- * \brief growheap
+ * \brief mallopt
  *
- * Given a requested size of memory, use sbrk() to dynamically 
- * increase the data segment of the calling process.  Updates
- * the free list with the newly allocated memory.
+ * Adjusts allocator parameters at run time.  M_MMAP_THRESHOLD and
+ * M_TRIM_THRESHOLD are supported.
  *
- * \param last tail of the free _block list
- * \param size size in bytes to request from the OS
+ * \param param parameter to change
+ * \param value new value
  *
- * \return returns the newly allocated _block of NULL if failed
+ * \return 1 on success, 0 if the parameter is not supported
  */
-struct _block *growHeap(struct _block *last, size_t size) 
+int mallopt(int param, int value)
 {
-   /* Request more space from OS */
-   struct _block *curr = (struct _block *)sbrk(0);
-   struct _block *prev = (struct _block *)sbrk(sizeof(struct _block) + size);
-
-   assert(curr == prev);
-
-   /* OS allocation failed */
-   if (curr == (struct _block *)-1) 
-   {
-      return NULL;
-   }
-
-   /* Update heapList if not set */
-   if (heapList == NULL) 
-   {
-      heapList = curr;
-   }
-
-   /* Attach new _block to prev _block */
-   if(last) 
-   {
-      last->next = curr;
-   }
-
-   /* Update _block metadata */
-  num_grows++;
-  curr->size = size;
-  curr->next = NULL;
-  curr->free = false;
-  // if(curr)
-  //   printf("Block is: %p\n", curr);
-  if(last)
-  {
-    curr->prev = last;
+  if (param == M_MMAP_THRESHOLD && value >= 0)
+  {
+    mmapThreshold = (size_t)value;
+    return 1;
   }
-  else
-    curr->prev = NULL;
-  max_heap = max_heap + size;
-  return curr;
+  if (param == M_TRIM_THRESHOLD && value >= 0)
+  {
+    trimThreshold = (size_t)value;
+    return 1;
+  }
+  return 0;
 }
 
 /*
- * \brief malloc
+ * \brief malloc_trim
  *
- * finds a free _block of heap memory for the calling process.
- * if there is no free _block that satisfies the request then grows the 
- * heap and returns a new _block
+ * Returns the calling thread's cached _blocks to their arenas, then gives
+ * every page of free memory in every arena back to the kernel.
  *
- * \param size size of the requested memory in bytes
+ * \param pad bytes to leave at the top of each arena
  *
- * \return returns the requested memory allocation to the calling process 
- * or NULL if failed
+ * \return 1 if any memory was released, 0 otherwise
  */
-void *malloc(size_t size) 
+int malloc_trim(size_t pad)
 {
+  for (int bin = 0; bin < TCACHE_BINS; bin++)
+  {
+    tcacheFlush(bin, 0);
+  }
+  for (int cls = 0; cls < SLAB_CLASSES; cls++)
+  {
+    slotFlush(cls, 0);
+  }
 
-  if( atexit_registered == 0 )
+  size_t released = 0;
+  for (int i = 0; i < numArenas; i++)
   {
-    // num_mallocs--;
-    atexit_registered = 1;
-    atexit( printStatistics );
+    struct _arena *a = lockArena(&arenas[i]);
+    drainRemoteFrees(a);
+    quickConsolidate(a);
+    released += heapTrim(a, pad);
+    pthread_mutex_unlock(&a->lock);
   }
-  num_requested = num_requested + size;
+  return released != 0;
+}
 
-  /* Align to multiple of 4 */
-  size = ALIGN4(size);
 
-  /* Handle 0 size */
-  if (size == 0) 
+/*
+ * \brief alignedAlloc
+ *
+ * Allocates size bytes at an alignment stricter than malloc()'s.  Large
+ * requests get a mapping that starts on the boundary.  Otherwise enough
+ * is taken from the arena to find a boundary with room for a free _block
+ * in front of it; that leading slack is freed, and so is whatever is
+ * left past size bytes.
+ *
+ * \param alignment a power of two
+ * \param size requested payload size in bytes
+ *
+ * \return the memory or NULL if it could not be allocated
+ */
+static void *alignedAlloc(size_t alignment, size_t size)
+{
+  if (alignment <= ALIGNMENT)
+  {
+    /* Only the 8 byte slab class has slots off an ALIGNMENT boundary, so
+       a request below the alignment takes a class whose slot size is a
+       multiple of it */
+    if (size != 0 && size < alignment)
+    {
+      size = alignment;
+    }
+    return allocate(size, NULL);
+  }
+  if (heapState != 2)
+  {
+    heapInit();
+  }
+  if (size == 0 || size > MAX_REQUEST - alignment)
   {
     return NULL;
   }
 
-  /* Look for free _block */
-  struct _block *last = heapList;
-  struct _block *next = findFreeBlock(&last, size);
-
-  /* TODO: Split free _block if possible */
-  
-  struct _block* temp = NULL;
-  // Split the blocks
-  if(next && next->size - size > 2 * sizeof(struct _block))
-  { 
+  if (size + alignment >= mmapThreshold)
+  {
+    struct _block *b = mmapAlloc(size, alignment);
+    if (b == NULL)
+    {
+      return NULL;
+    }
+    THREAD_COUNT(mallocs, 1);
+    THREAD_COUNT(requested, size);
+    return BLOCK_DATA(b);
+  }
 
-    temp = BLOCK_DATA(next) + (size/sizeof(struct _block));
-    temp->size = next->size - size - sizeof(struct _block);
-    temp->free = true;
-    temp->prev = next;
-    temp->next = next->next;
-    if(next->next)
+  size_t slack = sizeof(struct _block) + MIN_PAYLOAD;
+  struct _arena *a = lockArena(threadArenaBind());
+  drainRemoteFrees(a);
+  a->num_requested = a->num_requested + size;
+  struct _block *b = heapAlloc(a, ALIGN_PAYLOAD(size + alignment + slack),
+                               NULL);
+  if (b)
+  {
+    uintptr_t data = (uintptr_t)BLOCK_DATA(b);
+    if (data & (alignment - 1))
     {
-      next->next->prev = temp;
+      /* Free everything in front of the first boundary with room for a
+         _block ahead of it */
+      uintptr_t want = (data + slack + alignment - 1) &
+                       ~(uintptr_t)(alignment - 1);
+      struct _block *aligned = (struct _block *)want - 1;
+      size_t lead = (char *)aligned - (char *)b;
+      aligned->head = (b->head & ~(SIZE_MASK | 7)) | (BLOCK_SIZE(b) - lead);
+      SET_SIZE(b, lead - sizeof(struct _block));
+      heapFree(a, b);
+      b = aligned;
     }
-    next->size = size;
-    next->next = temp;
-    num_blocks++;
-    num_splits++;
+    size_t payload = ALIGN_PAYLOAD(size);
+    heapResize(a, b, payload < MIN_PAYLOAD ? MIN_PAYLOAD : payload);
   }
-  /* Could not find free _block, so grow heap */
-  if (next == NULL) 
+  pthread_mutex_unlock(&a->lock);
+  return b ? BLOCK_DATA(b) : NULL;
+}
+
+/*
+ * \brief posix_memalign
+ *
+ * \param memptr where to store the memory
+ * \param alignment a power of two multiple of sizeof(void *)
+ * \param size requested size in bytes
+ *
+ * \return 0 on success, EINVAL for a bad alignment, ENOMEM if out of memory
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
   {
-    next = growHeap(last, size);
+    return EINVAL;
   }
-  else
+  void *ptr = alignedAlloc(alignment, size);
+  PROFILE_ALLOC(ptr, size);
+  if (ptr == NULL && size != 0)
   {
-    num_reuses++;
+    return ENOMEM;
   }
-  /* Could not find free _block or grow heap, so just return NULL */
-  if (next == NULL) 
+  *memptr = ptr;
+  return 0;
+}
+
+/*
+ * \brief aligned_alloc
+ *
+ * \return memory aligned to alignment, or NULL with errno set to EINVAL
+ * if alignment is not a power of two
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)))
   {
+    errno = EINVAL;
     return NULL;
   }
-   
-  /* Mark _block as in use */
-  next->free = false;
+  void *ptr = alignedAlloc(alignment, size);
+  PROFILE_ALLOC(ptr, size);
+  return ptr;
+}
 
-  num_mallocs++;
-  /* Return data address associated with _block */
-  return BLOCK_DATA(next);
+/*
+ * \brief memalign
+ *
+ * \return memory aligned to alignment, rounded up to a power of two
+ */
+void *memalign(size_t alignment, size_t size)
+{
+  if (alignment & (alignment - 1))
+  {
+    alignment = (size_t)1 << (64 - __builtin_clzll(alignment));
+  }
+  void *ptr = alignedAlloc(alignment, size);
+  PROFILE_ALLOC(ptr, size);
+  return ptr;
 }
 
-void* calloc(size_t nmemb, size_t size)
+/*
+ * \brief valloc
+ *
+ * \return page aligned memory
+ */
+void *valloc(size_t size)
 {
-  size_t total_size = nmemb * size;
-  struct _block *ptr = malloc(total_size);
+  void *ptr = alignedAlloc((size_t)sysconf(_SC_PAGESIZE), size);
+  PROFILE_ALLOC(ptr, size);
+  return ptr;
+}
 
-  memset(ptr, 0, size);
+/*
+ * \brief pvalloc
+ *
+ * \return page aligned memory rounded up to a whole number of pages
+ */
+void *pvalloc(size_t size)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size = (size + page - 1) & ~(page - 1);
+  void *ptr = alignedAlloc(page, size);
+  PROFILE_ALLOC(ptr, size);
   return ptr;
 }
 
+/*
+ * \brief malloc_usable_size
+ *
+ * \return bytes the caller may use at ptr, which can be more than it
+ * asked for, or 0 for NULL
+ */
+size_t malloc_usable_size(void *ptr)
+{
+  if (ptr == NULL)
+  {
+    return 0;
+  }
+  if (isSlot(ptr))
+  {
+    return SLAB_OF(ptr)->size;
+  }
+  return BLOCK_SIZE(BLOCK_HEADER(ptr));
+}
+
 
-void* realloc(void *ptr, size_t size)
+#define STAT_U64          0
+#define STAT_DOUBLE       1
+
+#define STAT_FIELD(field, type) \
+   { #field, offsetof(struct _stats, field), \
+     sizeof(((struct _stats *)0)->field), type }
+
+static const struct
 {
-  struct _block *header = BLOCK_HEADER(ptr);
-  size_t req_size = size - header->size;
-  if(req_size <= 0)
-  {
-    return BLOCK_DATA(header);
-  }
-  // if given ptr is the last block
-  // expand the block with the missing size.
-  // return back the same pointer.
-  if(header->next == NULL)
-  {
-    struct _block *new_ptr = malloc(req_size - sizeof(struct _block));
-    header->next = new_ptr->next;
-    header->size = header->size + new_ptr->size + sizeof(struct _block);
-    return BLOCK_DATA(header); 
-  }
-  // if ptr has free block next to it with the required size
-  // take req_size from free block
-  // reduce the size of free block
-  else if(header->next && header->next->free && 
-          header->next->size > req_size)
-  {
-    struct _block *new_ptr = header->next;
-    header->size = size;
-    header->next = BLOCK_DATA(header) + size/sizeof(struct _block);
-    header->next->size = new_ptr->size - req_size;
-    header->next->free = 1;
-    header->next->prev = header;
-    header->next->next = new_ptr->next;
-    return BLOCK_DATA(header);
+   const char *name;
+   size_t offset;
+   size_t size;
+   int type;
+} statFields[] =
+{
+   STAT_FIELD(mallocs, STAT_U64),
+   STAT_FIELD(frees, STAT_U64),
+   STAT_FIELD(reuses, STAT_U64),
+   STAT_FIELD(grows, STAT_U64),
+   STAT_FIELD(splits, STAT_U64),
+   STAT_FIELD(coalesces, STAT_U64),
+   STAT_FIELD(requested, STAT_U64),
+   STAT_FIELD(remote_frees, STAT_U64),
+   STAT_FIELD(mmaps, STAT_U64),
+   STAT_FIELD(trims, STAT_U64),
+   STAT_FIELD(quick_hits, STAT_U64),
+   STAT_FIELD(slabs, STAT_U64),
+   STAT_FIELD(heap_size, STAT_U64),
+   STAT_FIELD(max_heap, STAT_U64),
+   STAT_FIELD(huge_bytes, STAT_U64),
+   STAT_FIELD(free_blocks, STAT_U64),
+   STAT_FIELD(free_bytes, STAT_U64),
+   STAT_FIELD(largest_free, STAT_U64),
+   STAT_FIELD(searches, STAT_U64),
+   STAT_FIELD(searched, STAT_U64),
+   STAT_FIELD(fragmentation, STAT_DOUBLE),
+   STAT_FIELD(search_length, STAT_DOUBLE),
+   STAT_FIELD(request_sizes, STAT_U64),
+   STAT_FIELD(free_classes, STAT_U64),
+};
+
+#define NUM_STAT_FIELDS   (sizeof(statFields) / sizeof(statFields[0]))
+
+/*
+ * \brief statsAddCounts
+ *
+ * Adds one set of thread counts, which may be changing, to a snapshot.
+ *
+ * \return none
+ */
+static void statsAddCounts(struct _stats *st, struct _counts *c)
+{
+  uint64_t hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+  st->mallocs   += __atomic_load_n(&c->mallocs, __ATOMIC_RELAXED);
+  st->frees     += __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+  st->reuses    += hits;
+  st->requested += __atomic_load_n(&c->requested, __ATOMIC_RELAXED);
+  for (int i = 0; i < STAT_SIZES; i++)
+  {
+    st->request_sizes[i] += __atomic_load_n(&c->sizes[i], __ATOMIC_RELAXED);
   }
-  // none of the above conditions valid
-  // create new block with the size
-  // copy the data from the previous block
-  // free the previous block;
-  else
+}
+
+/*
+ * \brief statsCollect
+ *
+ * Takes a snapshot of the statistics of every arena and thread.  Each
+ * arena's lock is held only while its own counters and free lists are
+ * read.
+ *
+ * \param st receives the snapshot
+ *
+ * \return none
+ */
+static void statsCollect(struct _stats *st)
+{
+  memset(st, 0, sizeof(*st));
+  for (int i = 0; i < numArenas; i++)
   {
-    struct _block *new_ptr = malloc(size);
-    if(new_ptr)
+    struct _arena *a = lockArena(&arenas[i]);
+    st->mallocs      += a->num_mallocs;
+    st->frees        += a->num_frees;
+    st->reuses       += a->num_reuses;
+    st->grows        += a->num_grows;
+    st->splits       += a->num_splits;
+    st->coalesces    += a->num_coalesces;
+    st->requested    += a->num_requested;
+    st->remote_frees += a->num_remote_frees;
+    st->trims        += a->num_trims;
+    st->quick_hits   += a->num_quick_hits;
+    st->heap_size    += a->heap_size;
+    st->max_heap     += a->max_heap;
+    st->searches     += a->num_searches + a->searches;
+    st->searched     += a->num_searched + a->searched;
+
+    for (int bin = nextNonEmptyBin(a, 0); bin >= 0;
+         bin = nextNonEmptyBin(a, bin + 1))
     {
-      memcpy(new_ptr, BLOCK_DATA(header), header->size);
-      free(BLOCK_DATA(header));
+      struct _block *b = a->bins[bin];
+      do
+      {
+        st->free_classes[bin]++;
+        st->free_blocks++;
+        st->free_bytes += BLOCK_SIZE(b);
+        if (BLOCK_SIZE(b) > st->largest_free)
+        {
+          st->largest_free = BLOCK_SIZE(b);
+        }
+        b = FREE_LINKS(b)->nextFree;
+      } while (b != a->bins[bin]);
     }
-    return new_ptr;
+    if (a->top)
+    {
+      st->free_bytes += BLOCK_SIZE(a->top);
+      if (BLOCK_SIZE(a->top) > st->largest_free)
+      {
+        st->largest_free = BLOCK_SIZE(a->top);
+      }
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+
+  pthread_mutex_lock(&threadCachesLock);
+  for (struct _tcache *c = threadCaches; c; c = c->nextCache)
+  {
+    statsAddCounts(st, &c->stats);
+  }
+  statsAddCounts(st, &sharedStats);
+  pthread_mutex_unlock(&threadCachesLock);
+
+  st->mmaps = __atomic_load_n(&num_mmaps, __ATOMIC_RELAXED);
+  st->slabs = (uint64_t)__atomic_load_n(&num_slabs, __ATOMIC_RELAXED);
+  st->huge_bytes = hugePages ? hugeBacked() : 0;
+  if (st->free_bytes)
+  {
+    st->fragmentation = 1.0 - (double)st->largest_free / st->free_bytes;
+  }
+  if (st->searches)
+  {
+    st->search_length = (double)st->searched / st->searches;
   }
 }
+
 /*
- * \brief free
+ * \brief statsPrintf
  *
- * frees the memory _block pointed to by pointer. if the _block is adjacent
- * to another _block then coalesces (combines) them
+ * snprintf() onto the end of a buffer, dropping whatever does not fit.
  *
- * \param ptr the heap memory to free
+ * \param buf buffer
+ * \param size its size
+ * \param len bytes already in it, updated
  *
  * \return none
  */
-void free(void *ptr) 
+static void statsPrintf(char *buf, size_t size, size_t *len,
+                        const char *format, ...)
 {
-  if (ptr == NULL) 
+  if (*len >= size)
   {
     return;
   }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf + *len, size - *len, format, args);
+  va_end(args);
+  if (n > 0)
+  {
+    *len = *len + (size_t)n < size ? *len + (size_t)n : size - 1;
+  }
+}
 
-  /* Make _block as free */
-  struct _block *curr = BLOCK_HEADER(ptr);
-  assert(curr->free == 0);
-  curr->free = true;
-  num_blocks++;
-  num_frees++;
-  // struct _block * temp = curr;
-  //check if the blocks ahead are free
-  // merge all free blocks
-  
-  while(curr && curr->next && curr->next->free)
-  {
-    curr->size = curr->size + curr->next->size;// + sizeof(struct _block);
-    curr->next = curr->next->next;
-    num_blocks--;
-    num_coalesces++;
-  }
-  // check if blocks behind are free
-  // merge all free blocks
-  while(curr && curr->prev && curr->prev->free)
-  {
-    curr->prev->size = curr->prev->size + curr->size + sizeof(struct _block);
-    curr->prev->next = curr->next;
-    curr = curr->prev;
-    num_blocks--;
-    num_coalesces++;
-  }
-  /* TODO: Coalesce free _blocks if needed */
+/*
+ * \brief statsWrite
+ *
+ * write() that carries on after short writes and interruptions.
+ *
+ * \return none
+ */
+static void statsWrite(int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return;
+    }
+    buf = buf + n;
+    len = len - (size_t)n;
+  }
+}
+
+/*
+ * \brief mallctl
+ *
+ * Reads one statistic by name, "stats.<field>", in the style of
+ * jemalloc's mallctl().  Counters are uint64_t, fragmentation and
+ * search_length are double, and request_sizes and free_classes are
+ * arrays of uint64_t.  Every call takes a fresh snapshot.
+ *
+ * \param name statistic to read
+ * \param oldp receives the value, or NULL to ask only for its size
+ * \param oldlenp size of oldp on entry, size of the value on return
+ * \param newp must be NULL, statistics are read-only
+ * \param newlen must be 0
+ *
+ * \return 0, ENOENT for an unknown name, EINVAL if oldp is too small or
+ * EPERM on an attempt to write
+ */
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+            size_t newlen)
+{
+  if (strncmp(name, "stats.", 6) != 0)
+  {
+    return ENOENT;
+  }
+  for (size_t i = 0; i < NUM_STAT_FIELDS; i++)
+  {
+    if (strcmp(name + 6, statFields[i].name) != 0)
+    {
+      continue;
+    }
+    if (newp || newlen)
+    {
+      return EPERM;
+    }
+    if (oldp == NULL || oldlenp == NULL)
+    {
+      if (oldlenp)
+      {
+        *oldlenp = statFields[i].size;
+      }
+      return 0;
+    }
+    if (*oldlenp < statFields[i].size)
+    {
+      *oldlenp = statFields[i].size;
+      return EINVAL;
+    }
+    struct _stats st;
+    statsCollect(&st);
+    memcpy(oldp, (char *)&st + statFields[i].offset, statFields[i].size);
+    *oldlenp = statFields[i].size;
+    return 0;
+  }
+  return ENOENT;
 }
 
+/*
+ * \brief malloc_stats_dump
+ *
+ * Writes a snapshot of every statistic to a file, as CSV ("stat,value"
+ * rows, arrays as one "name.index" row per entry) if its name ends in
+ * ".csv" and as a single JSON object otherwise.  Safe to call at any
+ * time; nothing is allocated.
+ *
+ * \param path file to create or overwrite
+ *
+ * \return 0 or -1 with errno set if the file could not be opened
+ */
+int malloc_stats_dump(const char *path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  size_t pathLen = strlen(path);
+  bool csv = pathLen >= 4 && strcmp(path + pathLen - 4, ".csv") == 0;
+
+  struct _stats st;
+  statsCollect(&st);
+
+  char buf[16384];
+  size_t len = 0;
+  statsPrintf(buf, sizeof(buf), &len, csv ? "stat,value\n" : "{");
+  for (size_t i = 0; i < NUM_STAT_FIELDS; i++)
+  {
+    const char *field = (const char *)&st + statFields[i].offset;
+    const char *name = statFields[i].name;
+    const char *separator = csv || i == 0 ? "" : ", ";
+    if (statFields[i].type == STAT_DOUBLE)
+    {
+      double value = *(const double *)field;
+      statsPrintf(buf, sizeof(buf), &len,
+                  csv ? "%s%s,%.6f\n" : "%s\"%s\": %.6f", separator,
+                  name, value);
+      continue;
+    }
+    const uint64_t *values = (const uint64_t *)field;
+    size_t count = statFields[i].size / sizeof(uint64_t);
+    if (count == 1)
+    {
+      statsPrintf(buf, sizeof(buf), &len,
+                  csv ? "%s%s,%" PRIu64 "\n" : "%s\"%s\": %" PRIu64,
+                  separator, name, values[0]);
+      continue;
+    }
+    statsPrintf(buf, sizeof(buf), &len, csv ? "" : "%s\"%s\": [",
+                separator, name);
+    for (size_t j = 0; j < count; j++)
+    {
+      if (csv)
+      {
+        statsPrintf(buf, sizeof(buf), &len, "%s.%zu,%" PRIu64 "\n",
+                    name, j, values[j]);
+      }
+      else
+      {
+        statsPrintf(buf, sizeof(buf), &len, "%s%" PRIu64,
+                    j ? ", " : "", values[j]);
+      }
+    }
+    statsPrintf(buf, sizeof(buf), &len, csv ? "" : "]");
+  }
+  statsPrintf(buf, sizeof(buf), &len, csv ? "" : "}\n");
+
+  statsWrite(fd, buf, len);
+  close(fd);
+  return 0;
+}
 
 /* vim: set expandtab sts=3 sw=3 ts=6 ft=cpp: --------------------------------*/
@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#define NUM_ALLOCS 4096
+
+int main()
+{
+  printf("Running test 10 to pack tiny objects into slabs\n");
+
+  char * ptr_array[NUM_ALLOCS];
+  char * low = NULL;
+  char * high = NULL;
+  int i;
+
+  for ( i = 0; i < NUM_ALLOCS; i++ )
+  {
+    ptr_array[i] = ( char * ) malloc ( 8 );
+    *( long * ) ptr_array[i] = i;
+    if ( low == NULL || ptr_array[i] < low ) low = ptr_array[i];
+    if ( high == NULL || ptr_array[i] > high ) high = ptr_array[i];
+  }
+
+  printf("Bytes of address space per 8 byte object: %ld\n",
+         ( long ) ( high - low ) / ( NUM_ALLOCS - 1 ) );
+
+  for ( i = 0; i < NUM_ALLOCS; i++ )
+  {
+    if ( *( long * ) ptr_array[i] != i )
+    {
+      printf("Object %d was overwritten\n", i );
+      return 1;
+    }
+    free( ptr_array[i] );
+  }
+
+  return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+int main()
+{
+  printf("Running test 11 to resize a buffer in place with realloc\n");
+
+  char * buffer = ( char * ) malloc ( 128 );
+  int moves = 0;
+  int size;
+
+  memset( buffer, 'a', 128 );
+
+  for ( size = 256; size <= 64 * 1024; size += 128 )
+  {
+    char * grown = ( char * ) realloc ( buffer, size );
+    if ( grown != buffer )
+    {
+      moves++;
+    }
+    buffer = grown;
+    memset( buffer + size - 128, 'a', 128 );
+  }
+  printf("Buffer moved %d times while growing to %d bytes\n", moves, size - 128 );
+
+  char * shrunk = ( char * ) realloc ( buffer, 1024 );
+  printf("Shrinking kept the buffer in place: %s\n",
+         shrunk == buffer ? "yes" : "no" );
+
+  for ( size = 0; size < 1024; size++ )
+  {
+    if ( shrunk[size] != 'a' )
+    {
+      printf("Byte %d was lost\n", size );
+      return 1;
+    }
+  }
+  free( shrunk );
+
+  return 0;
+}
@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+
+int main()
+{
+  printf("Running test 12 to allocate aligned memory\n");
+
+  size_t alignments[] = { 32, 64, 256, 4096, 65536 };
+  size_t sizes[] = { 1, 100, 5000, 300000 };
+  int bad = 0;
+  unsigned i, j;
+
+  for ( i = 0; i < sizeof( alignments ) / sizeof( alignments[0] ); i++ )
+  {
+    for ( j = 0; j < sizeof( sizes ) / sizeof( sizes[0] ); j++ )
+    {
+      void * ptr = NULL;
+      if ( posix_memalign( &ptr, alignments[i], sizes[j] ) != 0 ||
+           ( uintptr_t ) ptr % alignments[i] != 0 ||
+           malloc_usable_size( ptr ) < sizes[j] )
+      {
+        printf("posix_memalign(%zu, %zu) failed: %p\n", alignments[i], sizes[j], ptr );
+        bad++;
+      }
+      memset( ptr, 0xab, sizes[j] );
+
+      char * other = ( char * ) memalign( alignments[i], sizes[j] );
+      if ( ( uintptr_t ) other % alignments[i] != 0 )
+      {
+        printf("memalign(%zu, %zu) failed: %p\n", alignments[i], sizes[j], other );
+        bad++;
+      }
+      memset( other, 0xcd, sizes[j] );
+
+      free( ptr );
+      free( other );
+    }
+  }
+
+  /* Tiny requests must not come back from the 8 byte class */
+  for ( j = 1; j <= 8; j++ )
+  {
+    void * small[64];
+    for ( i = 0; i < 64; i++ )
+    {
+      small[i] = NULL;
+      if ( i % 3 == 0 )
+      {
+        posix_memalign( &small[i], 16, j );
+      }
+      else if ( i % 3 == 1 )
+      {
+        small[i] = memalign( 16, j );
+      }
+      else
+      {
+        small[i] = aligned_alloc( 16, j );
+      }
+      if ( small[i] == NULL || ( uintptr_t ) small[i] % 16 != 0 )
+      {
+        printf("16 byte alignment of %u bytes failed: %p\n", j, small[i] );
+        bad++;
+      }
+    }
+    for ( i = 0; i < 64; i++ )
+    {
+      free( small[i] );
+    }
+  }
+
+  char * ptr = ( char * ) malloc ( 24 );
+  printf("malloc returns 16 byte aligned memory: %s\n",
+         ( uintptr_t ) ptr % 16 == 0 ? "yes" : "no" );
+  free( ptr );
+
+  printf("Misaligned allocations: %d\n", bad );
+
+  return bad != 0;
+}
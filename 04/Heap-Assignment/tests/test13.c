@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+/* Returns the index of the first non-zero byte or -1 */
+static int firstDirty( const unsigned char * ptr, size_t size )
+{
+  size_t i;
+  for ( i = 0; i < size; i++ )
+  {
+    if ( ptr[i] != 0 )
+    {
+      return ( int ) i;
+    }
+  }
+  return -1;
+}
+
+int main()
+{
+  printf("Running test 13 to check calloc clears reused memory\n");
+
+  size_t sizes[] = { 8, 40, 100, 1000, 5000, 70000, 300000 };
+  int count = sizeof( sizes ) / sizeof( sizes[0] );
+  int i;
+
+  for ( i = 0; i < count; i++ )
+  {
+    /* Leave garbage behind for calloc to find */
+    unsigned char * dirty = ( unsigned char * ) malloc ( sizes[i] );
+    memset( dirty, 0xff, sizes[i] );
+    free( dirty );
+
+    unsigned char * ptr = ( unsigned char * ) calloc ( 1, sizes[i] );
+    int at = firstDirty( ptr, sizes[i] );
+    if ( at >= 0 )
+    {
+      printf("calloc of %zu bytes left byte %d set\n", sizes[i], at );
+      return 1;
+    }
+    memset( ptr, 0xff, sizes[i] );
+    free( ptr );
+  }
+
+  /* Once trimmed, the same memory must still come back clear */
+  malloc_trim( 0 );
+  for ( i = 0; i < count; i++ )
+  {
+    unsigned char * ptr = ( unsigned char * ) calloc ( sizes[i], 1 );
+    if ( firstDirty( ptr, sizes[i] ) >= 0 )
+    {
+      printf("calloc of %zu bytes after a trim was not clear\n", sizes[i] );
+      return 1;
+    }
+    memset( ptr, 0xff, sizes[i] );
+    free( ptr );
+  }
+
+  size_t huge = ( size_t ) -1 / 8;
+  printf("calloc of too many elements returns %s\n",
+         calloc ( huge, 16 ) == NULL ? "NULL" : "memory" );
+  printf("All calloc'd memory was clear\n");
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+/* Only the preloaded allocator provides these */
+static size_t ( * malloc_batch )( size_t size, size_t n, void ** ptrs );
+static void ( * free_batch )( void ** ptrs, size_t n );
+
+#define COUNT 500
+
+int main()
+{
+  printf("Running test 14 to allocate and free objects in batches\n");
+
+  malloc_batch = dlsym( RTLD_DEFAULT, "malloc_batch" );
+  free_batch = dlsym( RTLD_DEFAULT, "free_batch" );
+  if ( malloc_batch == NULL || free_batch == NULL )
+  {
+    printf("The batch API is not available\n");
+    return 0;
+  }
+
+  size_t sizes[] = { 24, 200, 1000 };
+  void * ptrs[COUNT];
+  int i, j;
+
+  for ( i = 0; i < 3; i++ )
+  {
+    size_t got = malloc_batch( sizes[i], COUNT, ptrs );
+    int adjacent = 0;
+
+    for ( j = 0; j < ( int ) got; j++ )
+    {
+      memset( ptrs[j], j, sizes[i] );
+      if ( j > 0 && ( char * ) ptrs[j] - ( char * ) ptrs[j - 1] ==
+                    ( char * ) ptrs[1] - ( char * ) ptrs[0] )
+      {
+        adjacent++;
+      }
+    }
+    for ( j = 0; j < ( int ) got; j++ )
+    {
+      if ( ( ( unsigned char * ) ptrs[j] )[sizes[i] - 1] != ( unsigned char ) j )
+      {
+        printf("Object %d of %zu bytes was overwritten\n", j, sizes[i] );
+        return 1;
+      }
+    }
+    printf("Got %zu objects of %zu bytes, %d evenly spaced\n",
+           got, sizes[i], adjacent + 1 );
+
+    free_batch( ptrs, got );
+  }
+
+  /* The batch must be reusable by plain malloc */
+  char * ptr = ( char * ) malloc ( 1000 );
+  memset( ptr, 'a', 1000 );
+  free( ptr );
+
+  return 0;
+}
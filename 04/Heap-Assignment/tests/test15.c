@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+/* Only the preloaded allocator provides this */
+static void ( * free_sized_fn )( void * ptr, size_t size );
+
+int main()
+{
+  printf("Running test 15 to free memory with its size\n");
+
+  free_sized_fn = dlsym( RTLD_DEFAULT, "free_sized" );
+  if ( free_sized_fn == NULL )
+  {
+    printf("free_sized is not available\n");
+    return 0;
+  }
+
+  size_t sizes[] = { 8, 16, 40, 64, 100, 5000 };
+  int reused = 0;
+  int i;
+
+  for ( i = 0; i < 6; i++ )
+  {
+    char * ptr = ( char * ) malloc ( sizes[i] );
+    memset( ptr, 'a', sizes[i] );
+    free_sized_fn( ptr, sizes[i] );
+
+    char * again = ( char * ) malloc ( sizes[i] );
+    if ( again == ptr )
+    {
+      reused++;
+    }
+    free_sized_fn( again, sizes[i] );
+  }
+  printf("%d of 6 sizes were handed straight back\n", reused );
+
+  /* A shrink into a smaller class is freed with the new size */
+  char * ptr = ( char * ) malloc ( 64 );
+  memset( ptr, 'b', 64 );
+  char * shrunk = ( char * ) realloc ( ptr, 8 );
+  if ( shrunk[7] != 'b' )
+  {
+    printf("realloc lost the data\n");
+    return 1;
+  }
+  free_sized_fn( shrunk, 8 );
+
+  char * small = ( char * ) malloc ( 8 );
+  char * large = ( char * ) malloc ( 64 );
+  memset( small, 'c', 8 );
+  memset( large, 'd', 64 );
+  printf("Small and large objects are distinct: %s\n",
+         small != large ? "yes" : "no" );
+  free( small );
+  free( large );
+
+  /* An aligned request may be served from a larger class than its size */
+  void * aligned = NULL;
+  posix_memalign( &aligned, 16, 4 );
+  free_sized_fn( aligned, 4 );
+  char * tiny = ( char * ) malloc ( 8 );
+  printf("Aligned objects go back to their own class: %s\n",
+         tiny != aligned ? "yes" : "no" );
+  free( tiny );
+
+  return 0;
+}
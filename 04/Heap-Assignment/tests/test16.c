@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+/* Only the preloaded allocator provides this */
+static int ( * mallctl_fn )( const char * name, void * oldp, size_t * oldlenp,
+                             void * newp, size_t newlen );
+
+static uint64_t readCounter( const char * name )
+{
+  uint64_t value = 0;
+  size_t len = sizeof( value );
+  mallctl_fn( name, &value, &len, NULL, 0 );
+  return value;
+}
+
+static void * worker( void * arg )
+{
+  int i;
+  for ( i = 0; i < 1000; i++ )
+  {
+    free( malloc( 100 ) );
+  }
+  return arg;
+}
+
+int main()
+{
+  printf("Running test 16 to read statistics while running\n");
+
+  mallctl_fn = dlsym( RTLD_DEFAULT, "mallctl" );
+  if ( mallctl_fn == NULL )
+  {
+    printf("mallctl is not available\n");
+    return 0;
+  }
+
+  uint64_t before = readCounter( "stats.mallocs" );
+  pthread_t threads[4];
+  int i;
+  for ( i = 0; i < 4; i++ )
+  {
+    pthread_create( &threads[i], NULL, worker, NULL );
+  }
+  for ( i = 0; i < 4; i++ )
+  {
+    pthread_join( threads[i], NULL );
+  }
+  worker( NULL );
+  uint64_t after = readCounter( "stats.mallocs" );
+  printf("Counted all 5000 mallocs: %s\n",
+         after - before >= 5000 ? "yes" : "no" );
+
+  uint64_t sizes[64];
+  size_t len = sizeof( sizes );
+  mallctl_fn( "stats.request_sizes", sizes, &len, NULL, 0 );
+  printf("Requests of 64 to 127 bytes: at least 5000: %s\n",
+         sizes[6] >= 5000 ? "yes" : "no" );
+
+  double fragmentation = -1;
+  len = sizeof( fragmentation );
+  mallctl_fn( "stats.fragmentation", &fragmentation, &len, NULL, 0 );
+  printf("Fragmentation is a ratio: %s\n",
+         fragmentation >= 0 && fragmentation <= 1 ? "yes" : "no" );
+
+  len = sizeof( before );
+  printf("Huge page bytes are reported: %s\n",
+         mallctl_fn( "stats.huge_bytes", &before, &len, NULL, 0 ) == 0 ?
+         "yes" : "no" );
+
+  len = sizeof( before );
+  printf("Unknown names are rejected: %s\n",
+         mallctl_fn( "stats.nothing", &before, &len, NULL, 0 ) != 0 ?
+         "yes" : "no" );
+
+  return 0;
+}
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+/* Only the preloaded allocator provides this */
+static int ( * malloc_profile_dump )( const char * path );
+
+#define COUNT 4000
+#define SIZE  2000
+#define BIG   ( 4 << 20 )
+
+/* Adds up the byte column of a folded profile */
+static double liveBytes( const char * path )
+{
+  char line[8192];
+  double total = 0;
+  FILE * file = fopen( path, "r" );
+  if ( file == NULL )
+  {
+    return -1;
+  }
+  while ( fgets( line, sizeof( line ), file ) )
+  {
+    char * bytes = strrchr( line, ' ' );
+    if ( bytes )
+    {
+      total += atof( bytes + 1 );
+    }
+  }
+  fclose( file );
+  return total;
+}
+
+int main( int argc, char * argv[] )
+{
+  /* Profiling is set up on the first malloc, so start again with it on */
+  if ( getenv( "MALLOC_PROFILE" ) == NULL )
+  {
+    setenv( "MALLOC_PROFILE", "1", 1 );
+    setenv( "MALLOC_PROFILE_RATE", "4096", 1 );
+    setenv( "MALLOC_PROFILE_FILE", "/dev/null", 1 );
+    execv( "/proc/self/exe", argv );
+  }
+
+  printf("Running test 17 to profile the live heap\n");
+
+  malloc_profile_dump = dlsym( RTLD_DEFAULT, "malloc_profile_dump" );
+  if ( malloc_profile_dump == NULL )
+  {
+    printf("The heap profiler is not available\n");
+    return 0;
+  }
+
+  char folded[64], heap[64];
+  snprintf( folded, sizeof( folded ), "/tmp/test17.%d.folded", ( int ) getpid() );
+  snprintf( heap, sizeof( heap ), "/tmp/test17.%d.heap", ( int ) getpid() );
+
+  static void * ptrs[COUNT];
+  int i;
+  for ( i = 0; i < COUNT; i++ )
+  {
+    ptrs[i] = malloc( SIZE );
+  }
+
+  malloc_profile_dump( folded );
+  double live = liveBytes( folded );
+  printf("Estimated %.0f of %d live bytes, within 20%%: %s\n", live,
+         COUNT * SIZE, live > COUNT * SIZE * 0.8 && live < COUNT * SIZE * 1.2 ?
+         "yes" : "no" );
+
+  malloc_profile_dump( heap );
+  char line[256] = "";
+  FILE * file = fopen( heap, "r" );
+  if ( file )
+  {
+    fgets( line, sizeof( line ), file );
+    fclose( file );
+  }
+  printf("pprof heap header: %s\n",
+         strncmp( line, "heap profile:", 13 ) == 0 ? "yes" : "no" );
+
+  for ( i = 0; i < COUNT; i++ )
+  {
+    free( ptrs[i] );
+  }
+  malloc_profile_dump( folded );
+  live = liveBytes( folded );
+  printf("Freed objects leave the profile: %s\n",
+         live < COUNT * SIZE * 0.05 ? "yes" : "no" );
+
+  /* Large enough to be sampled for certain and moved by the resize */
+  char * big = realloc( malloc( BIG / 20 ), BIG );
+  malloc_profile_dump( folded );
+  live = liveBytes( folded );
+  printf("Moved objects keep their place in the profile: %s\n",
+         live > BIG * 0.8 && live < BIG * 1.2 ? "yes" : "no" );
+  free( big );
+  malloc_profile_dump( folded );
+  live = liveBytes( folded );
+  printf("Freed moved objects leave the profile: %s\n",
+         live < BIG * 0.01 ? "yes" : "no" );
+
+  unlink( folded );
+  unlink( heap );
+  return 0;
+}
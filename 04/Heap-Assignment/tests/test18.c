@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+
+#include "../src/events.h"
+
+#define COUNT 1000
+
+int main( int argc, char * argv[] )
+{
+  /* The child allocates with tracing on; the log is complete at its exit */
+  if ( argc > 1 )
+  {
+    int i;
+    for ( i = 0; i < COUNT; i++ )
+    {
+      free( realloc( malloc( 100 ), 5000 ) );
+    }
+    return 0;
+  }
+
+  printf("Running test 18 to trace allocation events\n");
+
+  /* Only the preloaded allocator traces events */
+  if ( dlsym( RTLD_DEFAULT, "malloc_profile_dump" ) == NULL )
+  {
+    printf("Event tracing is not available\n");
+    return 0;
+  }
+
+  char path[64];
+  snprintf( path, sizeof( path ), "/tmp/test18.%d.events", ( int ) getpid() );
+  pid_t pid = fork();
+  if ( pid == 0 )
+  {
+    setenv( "MALLOC_EVENTS", path, 1 );
+    execl( "/proc/self/exe", argv[0], "child", ( char * ) NULL );
+    _exit( 1 );
+  }
+  int status;
+  waitpid( pid, &status, 0 );
+
+  char magic[EVENTS_MAGIC_SIZE] = "";
+  struct _event e;
+  int counts[EVENT_DROPPED + 1] = { 0 };
+  int ordered = 1;
+  unsigned long long last = 0;
+  FILE * file = fopen( path, "r" );
+  if ( file )
+  {
+    fread( magic, 1, sizeof( magic ), file );
+    while ( fread( &e, sizeof( e ), 1, file ) == 1 )
+    {
+      if ( e.type <= EVENT_DROPPED )
+      {
+        counts[e.type]++;
+      }
+      if ( e.type == EVENT_MALLOC )
+      {
+        ordered = ordered && e.tsc >= last;
+        last = e.tsc;
+      }
+    }
+    fclose( file );
+  }
+  unlink( path );
+
+  printf("Event log written: %s\n",
+         memcmp( magic, EVENTS_MAGIC, EVENTS_MAGIC_SIZE ) == 0 ? "yes" : "no" );
+  printf("Every malloc, realloc and free logged: %s\n",
+         counts[EVENT_MALLOC] >= COUNT && counts[EVENT_REALLOC] >= COUNT &&
+         counts[EVENT_FREE] >= COUNT ? "yes" : "no" );
+  printf("Clock records to convert time stamps: %s\n",
+         counts[EVENT_CLOCK] >= 2 ? "yes" : "no" );
+  printf("Events of one thread in time order: %s\n", ordered ? "yes" : "no" );
+
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define NUM_THREADS 8
+#define NUM_ALLOCS  1000
+
+static void * worker( void * arg )
+{
+  char * ptr_array[NUM_ALLOCS];
+  int i;
+  int round;
+
+  for ( round = 0; round < 100; round++ )
+  {
+    for ( i = 0; i < NUM_ALLOCS; i++ )
+    {
+      ptr_array[i] = ( char * ) malloc ( ( i % 64 ) * 8 + 1 );
+      ptr_array[i][0] = ( char ) i;
+    }
+
+    for ( i = 0; i < NUM_ALLOCS; i++ )
+    {
+      if ( ptr_array[i][0] != ( char ) i )
+      {
+        printf("Block %d was overwritten by another thread\n", i );
+      }
+      free( ptr_array[i] );
+    }
+  }
+
+  return arg;
+}
+
+int main()
+{
+  printf("Running test 7 to exercise malloc and free from several threads\n");
+
+  pthread_t threads[NUM_THREADS];
+  int i;
+
+  for ( i = 0; i < NUM_THREADS; i++ )
+  {
+    pthread_create( &threads[i], NULL, worker, NULL );
+  }
+
+  for ( i = 0; i < NUM_THREADS; i++ )
+  {
+    pthread_join( threads[i], NULL );
+  }
+
+  return 0;
+}
@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define NUM_ALLOCS 1024
+
+static char * ptr_array[NUM_ALLOCS];
+
+static void * consumer( void * arg )
+{
+  int i;
+  for ( i = 0; i < NUM_ALLOCS; i++ )
+  {
+    free( ptr_array[i] );
+  }
+  return arg;
+}
+
+int main()
+{
+  printf("Running test 8 to free blocks on a different thread than malloc\n");
+
+  pthread_t thread;
+  int i;
+  int round;
+
+  for ( round = 0; round < 10; round++ )
+  {
+    for ( i = 0; i < NUM_ALLOCS; i++ )
+    {
+      ptr_array[i] = ( char * ) malloc ( ( i % 32 ) * 64 + 1 );
+    }
+
+    pthread_create( &thread, NULL, consumer, NULL );
+    pthread_join( thread, NULL );
+  }
+
+  char * ptr = ( char * ) malloc ( 2048 );
+  printf("Blocks freed by the consumer are reused: %p\n", ptr );
+  free( ptr );
+
+  return 0;
+}
@@ -0,0 +1,33 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#define NUM_ALLOCS 256
+
+int main()
+{
+  printf("Running test 9 to give freed memory back to the OS\n");
+
+  char * ptr_array[NUM_ALLOCS];
+  int i;
+
+  for ( i = 0; i < NUM_ALLOCS; i++ )
+  {
+    ptr_array[i] = ( char * ) malloc ( 16384 );
+    ptr_array[i][0] = 1;
+  }
+
+  char * peak = sbrk( 0 );
+
+  for ( i = 0; i < NUM_ALLOCS; i++ )
+  {
+    free( ptr_array[i] );
+  }
+  malloc_trim( 0 );
+
+  char * trimmed = sbrk( 0 );
+  printf("Program break shrank by %ld bytes\n", ( long ) ( peak - trimmed ) );
+
+  return 0;
+}